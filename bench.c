@@ -0,0 +1,210 @@
+/*
+ * Trace replay benchmark for the allocator in mm.c.
+ *
+ * A trace is a text file.  The first non-comment line declares how many
+ * block ids the trace uses, then one operation per line:
+ *
+ *      ids <n>
+ *      a <id> <size>      allocate <size> bytes as block <id>
+ *      r <id> <size>      reallocate block <id> to <size> bytes
+ *      f <id>             free block <id>
+ *
+ * Lines starting with '#' are comments.  The driver replays the trace
+ * against mm_malloc/mm_realloc/mm_free and reports:
+ *
+ *      - throughput in operations per second (parsing is not timed),
+ *      - peak live bytes (sum of requested sizes of live blocks),
+ *      - heap bytes used (mm_heap_used high-water mark), and
+ *      - utilization = peak live bytes / heap bytes used.
+ *
+ * Run one trace per invocation so each trace starts on a fresh heap:
+ *
+ *      make bench
+ *      for t in $(ls traces); do ./bench traces/$t; done
+ *
+ * or "make check" to replay them all.
+ *
+ * Canned traces live in traces/: small-object churn, realloc growth,
+ * fragmentation stress, and a producer/consumer FIFO.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "memlib.h"
+#include "mm.h"
+
+/* One parsed trace operation. */
+struct op {
+        char kind;      /* 'a', 'r', or 'f' */
+        int id;         /* Block id */
+        size_t size;    /* Request size for 'a' and 'r' */
+};
+
+/*
+ * Requires:
+ *      "path" names a readable trace file.
+ *
+ * Effects:
+ *      Parses the trace into a malloc'd array of ops.  Returns the number
+ *      of ops and stores the array and id count through the out arguments.
+ *      Exits with an error message if the trace is malformed.
+ */
+static size_t
+parse_trace(const char *path, struct op **ops_out, int *ids_out)
+{
+        FILE *fp;
+        char line[128];
+        struct op *ops;
+        size_t nops = 0, cap = 4096;
+        int ids = -1;
+
+        if ((fp = fopen(path, "r")) == NULL) {
+                fprintf(stderr, "bench: cannot open %s\n", path);
+                exit(1);
+        }
+        ops = malloc(cap * sizeof(struct op));
+
+        while (fgets(line, sizeof(line), fp) != NULL) {
+                if (line[0] == '#' || line[0] == '\n')
+                        continue;
+                if (ids < 0) {
+                        if (sscanf(line, "ids %d", &ids) != 1 || ids <= 0) {
+                                fprintf(stderr, "bench: %s: bad ids line\n", path);
+                                exit(1);
+                        }
+                        continue;
+                }
+                if (nops == cap) {
+                        cap *= 2;
+                        ops = realloc(ops, cap * sizeof(struct op));
+                }
+
+                struct op *op = &ops[nops];
+                unsigned long sz;
+                if (sscanf(line, "a %d %lu", &op->id, &sz) == 2) {
+                        op->kind = 'a';
+                        op->size = sz;
+                } else if (sscanf(line, "r %d %lu", &op->id, &sz) == 2) {
+                        op->kind = 'r';
+                        op->size = sz;
+                } else if (sscanf(line, "f %d", &op->id) == 1) {
+                        op->kind = 'f';
+                        op->size = 0;
+                } else {
+                        fprintf(stderr, "bench: %s: bad line: %s", path, line);
+                        exit(1);
+                }
+                if (op->id < 0 || op->id >= ids) {
+                        fprintf(stderr, "bench: %s: id %d out of range\n",
+                            path, op->id);
+                        exit(1);
+                }
+                nops++;
+        }
+        fclose(fp);
+
+        *ops_out = ops;
+        *ids_out = ids;
+        return (nops);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Returns the current monotonic time in seconds.
+ */
+static double
+now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ((double)ts.tv_sec + (double)ts.tv_nsec * 1e-9);
+}
+
+int
+main(int argc, char **argv)
+{
+        struct op *ops;
+        int ids;
+        size_t nops;
+
+        if (argc != 2) {
+                fprintf(stderr, "usage: %s <trace>\n", argv[0]);
+                return (1);
+        }
+        nops = parse_trace(argv[1], &ops, &ids);
+
+        void **blocks = calloc(ids, sizeof(void *));
+        size_t *sizes = calloc(ids, sizeof(size_t));
+
+        mem_init();
+        if (mm_init() != 0) {
+                fprintf(stderr, "bench: mm_init failed\n");
+                return (1);
+        }
+
+        size_t live = 0, peak_live = 0, peak_used = 0;
+        double start = now();
+
+        for (size_t i = 0; i < nops; i++) {
+                struct op *op = &ops[i];
+
+                switch (op->kind) {
+                case 'a':
+                        blocks[op->id] = mm_malloc(op->size);
+                        if (blocks[op->id] == NULL) {
+                                fprintf(stderr, "bench: malloc failed at op %zu\n", i);
+                                return (1);
+                        }
+                        live += op->size;
+                        sizes[op->id] = op->size;
+                        break;
+                case 'r':
+                        blocks[op->id] = mm_realloc(blocks[op->id], op->size);
+                        if (blocks[op->id] == NULL) {
+                                fprintf(stderr, "bench: realloc failed at op %zu\n", i);
+                                return (1);
+                        }
+                        live += op->size - sizes[op->id];
+                        sizes[op->id] = op->size;
+                        break;
+                case 'f':
+                        mm_free(blocks[op->id]);
+                        blocks[op->id] = NULL;
+                        live -= sizes[op->id];
+                        sizes[op->id] = 0;
+                        break;
+                }
+                if (live > peak_live) {
+                        peak_live = live;
+                        /* Heap growth only happens while live grows. */
+                        size_t used = mm_heap_used();
+                        if (used > peak_used)
+                                peak_used = used;
+                }
+        }
+
+        double elapsed = now() - start;
+        size_t used = mm_heap_used();
+        if (used > peak_used)
+                peak_used = used;
+
+        printf("%s: %zu ops in %.4f s (%.2f Mops/s)\n", argv[1], nops,
+            elapsed, (double)nops / elapsed / 1e6);
+        printf("  peak live %zu B, heap used %zu B, utilization %.1f%%\n",
+            peak_live, peak_used,
+            peak_used ? 100.0 * (double)peak_live / (double)peak_used : 0.0);
+
+        free(ops);
+        free(blocks);
+        free(sizes);
+        return (0);
+}
@@ -0,0 +1,173 @@
+/*
+ * memlib.c - A module that models the memory system.  The allocator in
+ * mm.c asks this module, not the operating system, for heap memory, so
+ * a driver can stand up and tear down heaps at will.
+ *
+ * The heap is a single MAX_HEAP-byte private anonymous mapping reserved
+ * up front with MAP_NORESERVE, so untouched pages cost nothing and
+ * mem_sbrk never has to move the heap.  The mapping passes a fixed
+ * address hint: mm_snapshot images only restore at the address they
+ * were taken from, and a stable base lets warm restarts of the same
+ * binary find their range free.  The hint is only a hint -- if the
+ * kernel places the heap elsewhere, everything but snapshot restore
+ * still works.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memlib.h"
+
+/* Largest heap mem_sbrk will hand out. */
+#define MAX_HEAP (1024UL * 1024 * 1024)
+
+/* Preferred base address of the heap mapping. */
+#define HEAP_HINT ((void *)0x710000000000UL)
+
+static char *heap_base;         /* First byte of the heap mapping */
+static char *cur_brk;           /* First byte beyond the heap area in use */
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Reserves the heap mapping and points the break at its start.
+ *      Exits on failure; a driver cannot run without a heap.
+ */
+void
+mem_init(void)
+{
+
+        heap_base = mmap(HEAP_HINT, MAX_HEAP, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (heap_base == MAP_FAILED) {
+                perror("mem_init: mmap");
+                exit(1);
+        }
+        cur_brk = heap_base;
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Unmaps the heap.
+ */
+void
+mem_deinit(void)
+{
+
+        munmap(heap_base, MAX_HEAP);
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Resets the break to the start of the heap, discarding nothing:
+ *      the pages stay mapped, so a following mm_init reuses them.
+ */
+void
+mem_reset_brk(void)
+{
+
+        cur_brk = heap_base;
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Extends the heap area in use by "incr" bytes, like the sbrk
+ *      system call.  Returns the old break, or (void *)-1 if "incr" is
+ *      negative or the heap would exceed MAX_HEAP.  Failure is silent:
+ *      the allocator probes for the largest reservation that fits.
+ */
+void *
+mem_sbrk(intptr_t incr)
+{
+        char *old_brk = cur_brk;
+
+        if (incr < 0 || cur_brk + incr > heap_base + MAX_HEAP)
+                return ((void *)-1);
+        cur_brk += incr;
+        return (old_brk);
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Returns the address of the first heap byte.
+ */
+void *
+mem_heap_lo(void)
+{
+
+        return (heap_base);
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Returns the address of the last heap byte in use.
+ */
+void *
+mem_heap_hi(void)
+{
+
+        return (cur_brk - 1);
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Returns the number of heap bytes in use.
+ */
+size_t
+mem_heapsize(void)
+{
+
+        return ((size_t)(cur_brk - heap_base));
+}
+
+/*
+ * Requires:
+ *      mem_init has been called.
+ *
+ * Effects:
+ *      Returns how many more bytes mem_sbrk can supply, so the allocator
+ *      can size its arena regions to the whole reservation.
+ */
+size_t
+mem_sbrk_capacity(void)
+{
+
+        return ((size_t)(heap_base + MAX_HEAP - cur_brk));
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Returns the system page size.
+ */
+size_t
+mem_pagesize(void)
+{
+
+        return ((size_t)sysconf(_SC_PAGESIZE));
+}
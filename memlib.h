@@ -0,0 +1,25 @@
+/*
+ * memlib.h - Interface to the memory system model in memlib.c.
+ *
+ * The allocator in mm.c obtains heap memory only through this module,
+ * never from the real sbrk, so drivers can create a fresh heap per run
+ * and the allocator stays testable in isolation.
+ */
+
+#ifndef MEMLIB_H
+#define MEMLIB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+void mem_init(void);
+void mem_deinit(void);
+void mem_reset_brk(void);
+void *mem_sbrk(intptr_t incr);
+size_t mem_sbrk_capacity(void);
+void *mem_heap_lo(void);
+void *mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+
+#endif /* MEMLIB_H */
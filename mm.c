@@ -1,10 +1,22 @@
-/* 
+/*
  * This is a 32-bit and 64-bit clean allocator based on segrageted explicit free lists,
  * first fit placement within the appropriate list, and boundary tag coalescing.
- * Blocks are aligned to word boundaries.  
+ * Blocks are aligned to word boundaries.
  * This yields 8-byte aligned blocks on a 32-bit processor as well as on a 64-bit processor.
  * The minimum block size is four words.
  *
+ * To scale across threads the heap is split into NUM_ARENAS independent arenas.
+ * Each arena owns a contiguous region of the heap, its own segregated free lists,
+ * and its own lock, so threads bound to different arenas never contend or share
+ * allocator cache lines.  Threads are bound to arenas round-robin on their first
+ * allocation, and a free is always routed to the arena that owns the block's
+ * address, so blocks never migrate between arenas.
+ *
+ * Only free blocks carry boundary tag footers.  Every header has a
+ * prev-allocated bit, so an allocated block saves the footer word entirely
+ * and coalesce reads the previous block's footer only when that bit says
+ * the previous block is free.
+ *
  * This allocator uses the size of a pointer, e.g., sizeof(void *), to
  * define the size of a word. This allocator also uses the standard
  * type uintptr_t to define unsigned integers that are the same size
@@ -14,21 +26,112 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "memlib.h"
 #include "mm.h"
 
 
-/* Basic constants and macros: */  
-#define WSIZE      8            /* Word size */ 
+/* Basic constants and macros: */
+#define WSIZE      8            /* Word size */
 #define DSIZE      (2 * WSIZE)  /* Doubleword size (bytes) */
-#define CHUNKSIZE  (1 << 12)    /* Extend heap by this amount (bytes) */
-#define NUM_SEGS   12           /* Free lists within size 2^5 2^6 ... 2^17 */
+#define CHUNKSIZE  (1 << 12)    /* Initial heap extension amount (bytes) */
 #define ALIGNMENT  8            /* Alignment */
 
-#define MAX(x, y)  ((x) > (y) ? (x) : (y))  
+/*
+ * Heap growth policy.  Each arena starts extending by GROWTH_CHUNK and
+ * doubles its extension size up to GROWTH_CHUNK_MAX, so ramping to a large
+ * footprint takes a logarithmic number of extensions instead of one per
+ * CHUNKSIZE.  Both knobs have compile-time defaults and can be overridden
+ * at startup with the MM_GROWTH_CHUNK and MM_GROWTH_MAX environment
+ * variables; MM_RESERVE pre-extends the arenas before the first request.
+ */
+#ifndef GROWTH_CHUNK
+#define GROWTH_CHUNK      CHUNKSIZE
+#endif
+#ifndef GROWTH_CHUNK_MAX
+#define GROWTH_CHUNK_MAX  (1 << 20)
+#endif
+
+/*
+ * Size-class table.  Sizes up to SMALL_CLASS_MAX get one exact class per
+ * aligned size, so the dominant small allocations always land in a list
+ * whose blocks fit them exactly.  Above that, classes double in size up to
+ * 2^MAX_CLASS_LOG, with the last class holding everything bigger.  Both
+ * knobs are tunable; the class count must stay within the 64 bits of the
+ * nonempty-class mask.
+ */
+#define SMALL_CLASS_MAX    256  /* Exact classes up to here, ALIGNMENT apart */
+#define SMALL_CLASS_LOG    8    /* log2(SMALL_CLASS_MAX) */
+#define MAX_CLASS_LOG      17   /* Largest geometric class; the last class is a catch-all */
+#define NUM_SMALL_CLASSES  ((int)((SMALL_CLASS_MAX - MIN_BLOCK_SIZE) / ALIGNMENT + 1))
+#define NUM_CLASSES        (NUM_SMALL_CLASSES + (MAX_CLASS_LOG - SMALL_CLASS_LOG + 1))
+
+#define SEARCH_BOUND  50        /* Free list nodes examined before bailing out */
+#define SEARCH_HIST_BUCKETS  8  /* Power-of-two search-length histogram buckets */
+
+#define DIRTY_RING  64          /* Recently touched blocks kept for sampled checking */
+
+#define MMAP_THRESHOLD  (256 * 1024)  /* Requests at least this big use mmap */
+
+#define MADVISE_THRESHOLD  (128 * 1024)  /* Free blocks at least this big return pages */
+
+#define CALLOC_MMAP_THRESHOLD  (64 * 1024)  /* Zeroed requests this big go to mmap */
+
+/*
+ * Debug guards, compiled in only with -DMM_GUARDS so the release hot path
+ * is untouched.  Each payload is bracketed by canaries: the word in front
+ * stores the requested size XORed with a magic constant, and a magic word
+ * sits right behind the last requested byte.  mm_free validates both and
+ * poisons the payload, which catches overruns, underruns, double frees,
+ * and use-after-free writes at the free site instead of at the next
+ * coalesce.
+ */
+#ifdef MM_GUARDS
+#define GUARD_FRONT_MAGIC  ((uintptr_t)0xC0FFEEC0FFEEC0FFull)
+#define GUARD_TAIL_MAGIC   ((uint64_t)0xDEFACEDDEFACEDD1ull)
+#define GUARD_POISON       0xDD
+#endif
+
+#define POOL_SLAB_BYTES  (1 << 16)  /* Slab size reserved by object pools */
+
+#define HUGEPAGE_SIZE  (2u << 20)  /* x86-64 huge page: 2 MB */
+
+#define CACHE_LINE   64         /* L1 line size assumed by coloring */
+#define COLOR_LINES  4          /* Lines the color rotation cycles over */
+
+#define SNAP_MAGIC     0x706d6d68656170ull  /* Snapshot file magic */
+#define SNAP_HDR_SIZE  4096     /* Header block; image follows page-aligned */
+
+#define NUM_ARENAS    8                   /* Number of independent arenas */
+
+/*
+ * Per-arena heap region.  mm_init sizes the regions from whatever the
+ * memory system can still supply -- mem_sbrk_capacity() divided evenly
+ * across the arenas -- so no part of the reservation is out of reach;
+ * MM_ARENA_REGION in the environment can shrink them.  An arena's heap
+ * can never outgrow its region, so the region size is also the per-arena
+ * ceiling; requests of MMAP_THRESHOLD bytes and up bypass the regions
+ * entirely.
+ */
+#define ARENA_REGION_MIN  (1UL << 20)   /* Smallest workable region */
+
+/* Thread-local magazine cache for small blocks: */
+#define MAG_MAX_ASIZE  (256 + DSIZE)                      /* Largest cached block size */
+#define MAG_MIN_ASIZE  (2 * WSIZE + 2 * WSIZE)            /* Smallest block size */
+#define NUM_MAG_BINS   (((MAG_MAX_ASIZE) - (MAG_MIN_ASIZE)) / ALIGNMENT + 1)
+#define MAG_CAP        32                                 /* Blocks held per bin */
+
+#define MAX(x, y)  ((x) > (y) ? (x) : (y))
+#define MIN(x, y)  ((x) < (y) ? (x) : (y))
 #define ALIGN(size)  (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT - 1))
 #define LOG2(i) 31 - __builtin_clz(i)
 
@@ -43,9 +146,50 @@
 
 
 /* Read the size and allocated fields from address p. */
-#define GET_SIZE(p)   (GET(p) & ~(ALIGNMENT - 1)) 
+#define GET_SIZE(p)   (GET(p) & ~(ALIGNMENT - 1))
+
+/*
+ * Unlocked readers (cross-thread frees) can observe an allocated block's
+ * header while the owning arena's lock holder rewrites its prev-alloc
+ * bit.  The size bits are immutable until the block is freed, but the
+ * access itself must be atomic to be defined; relaxed order is enough.
+ */
+#define GET_RELAXED(p)       (__atomic_load_n((uintptr_t *)(p), __ATOMIC_RELAXED))
+#define GET_SIZE_RELAXED(p)  (GET_RELAXED(p) & ~(ALIGNMENT - 1))
 #define GET_ALLOC(p)  (GET(p) & 0x1)
 
+/*
+ * Read, set, and clear the prev-allocated bit at address p.  Alignment
+ * leaves the low bits of the size free, so bit 1 of every header records
+ * whether the physically previous block is allocated.  Allocated blocks
+ * carry no footer; coalesce only reads the previous block's footer when
+ * this bit says the previous block is free.
+ *
+ * Set and clear are atomic read-modify-writes: they flip the bit on a
+ * neighbor that may be allocated, whose header a cross-thread free reads
+ * without the arena lock (see GET_RELAXED above).
+ */
+#define GET_PREVALLOC(p)  (GET(p) & 0x2)
+#define SET_PREVALLOC(p)  ((void)__atomic_fetch_or((uintptr_t *)(p), \
+    (uintptr_t)0x2, __ATOMIC_RELAXED))
+#define CLR_PREVALLOC(p)  ((void)__atomic_fetch_and((uintptr_t *)(p), \
+    ~(uintptr_t)0x2, __ATOMIC_RELAXED))
+
+/*
+ * Bit 2 marks a block that was served by mmap instead of an arena.  Such
+ * blocks live outside every arena region and are returned to the kernel
+ * with munmap on free.  On free blocks, which never carry the mmapped
+ * bit, the same bit instead records that the block's interior pages have
+ * already been madvised away, so churny workloads do not return the same
+ * pages twice.
+ */
+#define GET_MMAPPED(p)   (GET(p) & 0x4)
+#define GET_RETURNED(p)  (GET(p) & 0x4)
+#define SET_RETURNED(p)  PUT(p, GET(p) | 0x4)
+
+/* Minimum block size: header, footer, and list pointers of a free block. */
+#define MIN_BLOCK_SIZE  (2 * WSIZE + sizeof(struct pointers))
+
 
 /* Given block ptr bp, compute address of its header and footer. */
 #define HDRP(bp)  ((char *)(bp) - WSIZE)
@@ -57,37 +201,342 @@
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 
 
-/* Global variables: */
-static void *heap_listp;        /* Pointer to first block */ 
-struct pointers* free_lists;    /* Pointer to the array of free lists */
-
  /* Pointers structur */
 struct pointers {
-    struct pointers *next; /* next free block */ 
+    struct pointers *next; /* next free block */
     struct pointers *prev; /* previous block */
 };
 
+/* The public stats arrays in mm.h must track the class table here. */
+_Static_assert(MM_NUM_CLASSES == NUM_CLASSES,
+    "MM_NUM_CLASSES in mm.h is out of date");
+_Static_assert(MM_SEARCH_HIST_BUCKETS == SEARCH_HIST_BUCKETS,
+    "MM_SEARCH_HIST_BUCKETS in mm.h is out of date");
+
+/*
+ * A recently touched block remembered for the sampled checker.  The block
+ * can be merged away between the touch and the check, so the header word
+ * at touch time is kept alongside: if it no longer matches, the entry is
+ * stale and is skipped rather than reported.
+ */
+struct dirty_ent {
+    void *bp;                   /* Block address */
+    uintptr_t hdr;              /* Header word when the block was touched */
+};
+
+/* A slab reserved by an object pool; slabs are chained per pool. */
+struct pool_slab {
+    struct pool_slab *next;
+};
+
+/*
+ * A fixed-size object pool.  Slots carry no boundary tags at all: a slot
+ * is either handed out, on the pool's free-slot list (linked through the
+ * slot's first word), or in the never-yet-used tail of the newest slab.
+ */
+struct mm_pool {
+    size_t slot_size;           /* Aligned size of one slot */
+    struct pool_slab *slabs;    /* All slabs, newest first */
+    void *free;                 /* Free-slot freelist */
+    char *bump;                 /* First never-used byte of the newest slab */
+    char *bump_end;             /* End of the newest slab */
+    pthread_mutex_t lock;       /* Protects the pool */
+};
+
+/*
+ * On-disk header of a heap snapshot.  The image that follows is the raw
+ * memory from "base" for "length" bytes, stored at its offset from
+ * "base", and is only valid when mapped back at "base": every free-list
+ * pointer, treap link, and boundary tag in it is an absolute address.
+ */
+struct snap_header {
+    uint64_t magic;             /* SNAP_MAGIC */
+    uint64_t base;              /* Address the image must map at */
+    uint64_t length;            /* Bytes covered by the image */
+    uint64_t arenas_off;        /* Offset of the arena array from base */
+    uint64_t arena_base_off;    /* Offset of the first region from base */
+    uint64_t num_arenas;        /* NUM_ARENAS at snapshot time */
+    uint64_t arena_region;      /* Region size at snapshot time */
+    uint64_t arena_size;        /* sizeof(struct arena) at snapshot time */
+};
+
+/*
+ * Treap node, overlaid on the payload of free blocks in the catch-all
+ * largest class.  Those blocks are at least 2^MAX_CLASS_LOG bytes, so the
+ * extra node fields always fit.  The treap is ordered by (size, address)
+ * and heap-ordered by a priority hashed from the block address, which
+ * keeps it balanced in expectation and makes every operation O(log n).
+ */
+struct treap_node {
+    struct treap_node *left;   /* Smaller (size, address) keys */
+    struct treap_node *right;  /* Larger (size, address) keys */
+    uint32_t priority;         /* Heap priority, hashed from the address */
+};
+
+/*
+ * Per-class search statistics, kept per arena and updated under the arena
+ * lock.  They record how far find_block walks and how often it hits
+ * SEARCH_BOUND, so the bound can be tuned against real workloads.
+ */
+struct seg_stats {
+    uint64_t searches;  /* find_block calls on this class */
+    uint64_t scanned;   /* total free blocks examined */
+    uint64_t bailouts;  /* searches that hit SEARCH_BOUND */
+    uint64_t allocs;    /* blocks handed out in this class */
+    uint64_t frees;     /* blocks freed back into this class */
+};
+
+/*
+ * Arena structure.  Each arena is a self-contained heap: its own segregated
+ * free lists, its own prologue/epilogue delimited block area, and its own
+ * break pointer within [low, limit).  The lock serializes all list and
+ * boundary tag manipulation inside the arena.
+ */
+struct arena {
+    struct pointers free_lists[NUM_CLASSES];  /* Segregated free lists */
+    struct seg_stats stats[NUM_CLASSES];      /* Per-class search statistics */
+    uint64_t seg_map;                         /* Bit i set iff free_lists[i] is nonempty */
+    struct treap_node *big_root;           /* Treap over the catch-all class */
+    int deferred;                          /* Free blocks inserted without coalescing */
+    size_t grow_size;                      /* Next heap extension size (bytes) */
+    uint64_t mallocs;                      /* Blocks placed from this arena */
+    uint64_t frees;                        /* Blocks freed back to this arena */
+    uint64_t live_bytes;                   /* Block bytes currently allocated */
+    uint64_t extends;                      /* extend_heap calls */
+    uint64_t splits;                       /* Blocks split in place/realloc */
+    uint64_t coalesces;                    /* Block merges */
+    uint64_t madvises;                     /* madvise calls that returned pages */
+    uint64_t returned_bytes;               /* Page bytes handed back so far */
+    uint64_t search_hist[SEARCH_HIST_BUCKETS];  /* find_block walk lengths */
+    struct dirty_ent dirty_ring[DIRTY_RING];  /* Touched by place/coalesce */
+    unsigned dirty_head;                   /* Next dirty ring slot */
+    struct dirty_ent check_cursor;         /* Where the sampled walk resumes */
+    void *remote_free;                     /* Lock-free MPSC remote-free stack */
+    uint8_t color_rr[NUM_CLASSES];         /* Per-class color rotation */
+    pthread_mutex_t lock;                  /* Protects lists and blocks */
+    char *heap_listp;                      /* Pointer to first block */
+    char *brk;                             /* Current end of this arena's heap */
+    char *limit;                           /* End of this arena's region */
+};
+
+
+/* Global variables: */
+static struct arena *arenas;    /* Array of NUM_ARENAS arenas */
+static char *arena_base;        /* Start of the first arena's region */
+static size_t arena_region;     /* Region (and heap ceiling) per arena */
+static int next_arena;          /* Round-robin binding counter */
+
+/*
+ * When set, mm_free inserts blocks into the free lists without coalescing.
+ * Merging is batched: it runs when a fit search fails, or when the mode is
+ * switched back off.  Free-heavy phases can turn this on to make each free
+ * a plain list insert.
+ */
+static bool defer_coalescing;
+
+/* Growth policy, set once in mm_init from the defaults or environment. */
+static size_t growth_chunk;
+static size_t growth_max;
+
+/* Free tail left after growable blocks so realloc can grow in place. */
+static size_t growable_headroom = 1 << 12;
+
+/* Over-allocation factor applied when mm_realloc must move a block,
+ * in percent of the requested size.  100 means exact-size copies. */
+static unsigned realloc_growth_pct = 100;
+
+/* Set once checkheap_sampled runs; until then the dirty rings stay off
+ * and cost the allocation paths nothing. */
+static bool sampled_checking;
+
+/* Ask the kernel to back the heap with huge pages.  Defaults to on; set
+ * MM_HUGEPAGES=0 in the environment to turn it off. */
+static bool use_hugepages = true;
+
+/* Bind threads to arenas on their own NUMA node.  Defaults to on; set
+ * MM_NUMA=0 in the environment to turn it off. */
+static bool use_numa = true;
+
+/* NUMA node each arena's memory belongs to: stamped by the first thread
+ * that binds to the arena, -1 while still unclaimed. */
+static int arena_node[NUM_ARENAS];
+/* Threads bound per arena, to spread same-node threads out. */
+static int arena_bindings[NUM_ARENAS];
+
+/* Classes with cache-line coloring enabled; see mm_set_class_coloring. */
+static unsigned char class_colored[NUM_CLASSES];
+
+/*
+ * Insertion policy per size class.  Defaults are set in mm_init: LIFO for
+ * the exact small classes, address-ordered for everything bigger.  The
+ * catch-all class is a treap and ignores this table.
+ */
+static unsigned char class_policy[NUM_CLASSES];
+
+/* Counters for the paths that run outside any arena lock. */
+static uint64_t mag_alloc_hits;
+static uint64_t mag_free_hits;
+static uint64_t mmap_allocs;
+static uint64_t mmap_frees;
+static uint64_t mmap_bytes;
+static uint64_t realloc_calls;
+static uint64_t remote_free_pushes;
+
+/* Relaxed atomic increment/decrement for the unlocked counters. */
+#define COUNT_ADD(c, n)  __atomic_add_fetch(&(c), (n), __ATOMIC_RELAXED)
+#define COUNT_SUB(c, n)  __atomic_sub_fetch(&(c), (n), __ATOMIC_RELAXED)
+
+/* Arena this thread is bound to; assigned on first allocation. */
+static __thread struct arena *bound_arena;
+
+/*
+ * Magazine structure.  Each small size class keeps a bounded stack of
+ * recently freed blocks per thread.  Cached blocks stay marked allocated,
+ * so popping one services a malloc with no lock, no list traversal, and
+ * no header/footer rewrites.  One bin per aligned block size up to
+ * MAG_MAX_ASIZE.
+ */
+struct magazine {
+    void *blocks[MAG_CAP];  /* Stack of cached blocks */
+    int count;              /* Number of cached blocks */
+};
+
+/* This thread's magazines, one per small size class. */
+static __thread struct magazine magazines[NUM_MAG_BINS];
+
+/*
+ * Thread-exit hook for the magazines.  __thread storage has no
+ * destructor of its own, so the first block a thread caches registers
+ * its magazine array with this key; flush_magazines then runs at thread
+ * exit and returns the cached blocks to their arenas instead of
+ * stranding them.
+ */
+static pthread_key_t mag_key;
+static pthread_once_t mag_key_once = PTHREAD_ONCE_INIT;
+static __thread bool mag_registered;
+
 
 /* Function prototypes for internal helper routines: */
-static void *coalesce(void *bp);
-static void *extend_heap(size_t words);
-struct pointers *find_fit(size_t asize);
-static void place(void *bp, size_t asize);
+static void *coalesce(struct arena *a, void *bp);
+static void *extend_heap(struct arena *a, size_t words);
+struct pointers *find_fit(struct arena *a, size_t asize);
+static void place(struct arena *a, void *bp, size_t asize);
 
 /* Function prototypes for heap consistency checker routines: */
 static void checkblock(void *bp);
-static void checkheap(bool verbose);
-static void printblock(void *bp); 
+void checkheap(bool verbose);
+static void printblock(void *bp);
+static void mark_dirty(struct arena *a, void *bp);
+static void scrub_dirty(struct arena *a, void *bp);
+static bool block_sane(struct arena *a, void *bp);
 
 /* Helper functions: */
-static void insertNode(struct pointers *bp);
-static void removeNode(struct pointers *bp);
-static struct pointers* get_free_list_head(size_t size);
-struct pointers* find_block(struct pointers* list, size_t asize);
+static int size2class(size_t asize);
+static void insertNode(struct arena *a, struct pointers *bp);
+static void removeNode(struct arena *a, struct pointers *bp);
+static struct pointers* get_free_list_head(struct arena *a, size_t size);
+struct pointers* find_block(struct arena *a, int idx, size_t asize);
+
+/* Growth policy: */
+int mm_reserve(size_t bytes);
+void *mm_realloc_in_place(void *ptr, size_t size);
+void mm_set_realloc_growth(unsigned percent);
+
+/* Heap snapshots: */
+int mm_snapshot(const char *path);
+int mm_init_from_snapshot(const char *path);
+
+/* Arena helpers: */
+static int current_node(void);
+static struct arena *bind_arena(void);
+static struct arena *arena_of(void *bp);
+static bool is_mmapped_addr(void *bp);
+static void *arena_sbrk(struct arena *a, size_t incr);
+static void *arena_malloc(struct arena *a, size_t asize);
+static void *arena_memalign(struct arena *a, size_t asize, size_t alignment,
+    size_t off);
+static void *memalign_core(size_t alignment, size_t size, size_t off);
+static void *arena_malloc_headroom(struct arena *a, size_t asize);
+static void *growable_core(size_t size);
+static int arena_malloc_batch(struct arena *a, size_t asize, size_t count,
+    void **out);
+static int batch_core(size_t size, size_t count, void **out);
+static bool try_extend_next(struct arena *a, void *ptr, size_t oldsize,
+    size_t newsize);
+static size_t realloc_want(size_t size);
+static int addr_cmp(const void *x, const void *y);
+static void free_core(void *bp);
+static void free_block_locked(struct arena *a, void *bp);
+static void remote_free_push(struct arena *a, void *bp);
+static void drain_remote_frees(struct arena *a);
+
+/* Magazine helpers: */
+static int mag_bin(size_t asize);
+static void free_to_arena(void *bp);
+static void flush_magazines(void *arg);
+static void mag_key_init(void);
+
+/* Deferred coalescing: */
+static void coalesce_arena(struct arena *a);
+
+/* Memory return: */
+static void return_pages(struct arena *a, void *bp);
+
+/* Large objects: */
+static void *mmap_malloc(size_t size);
+
+/* Treap over the largest size class: */
+static struct treap_node *treap_insert(struct treap_node *root, struct treap_node *node);
+static struct treap_node *treap_remove(struct treap_node *root, struct treap_node *node);
+static struct treap_node *treap_merge(struct treap_node *l, struct treap_node *r);
+static struct treap_node *treap_find(struct treap_node *root, size_t asize);
+static bool treap_key_less(struct treap_node *x, struct treap_node *y);
+static uint32_t treap_priority(void *bp);
+
+
 
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      (Re)initializes the global configuration that is not part of the
+ *      heap image: growth policy, hugepage and NUMA switches, insertion
+ *      policies, and the thread-binding tables.  Shared by mm_init and
+ *      mm_init_from_snapshot.
+ */
+static void
+init_runtime_config(void)
+{
+        const char *env;
+
+        /* Growth policy: compile-time defaults, overridable at startup. */
+        growth_chunk = GROWTH_CHUNK;
+        growth_max = GROWTH_CHUNK_MAX;
+        if ((env = getenv("MM_GROWTH_CHUNK")) != NULL && atol(env) > 0)
+                growth_chunk = ALIGN((size_t)atol(env));
+        if ((env = getenv("MM_GROWTH_MAX")) != NULL && atol(env) > 0)
+                growth_max = ALIGN((size_t)atol(env));
+        if (growth_max < growth_chunk)
+                growth_max = growth_chunk;
+        if ((env = getenv("MM_HUGEPAGES")) != NULL && atol(env) == 0)
+                use_hugepages = false;
+        if ((env = getenv("MM_NUMA")) != NULL && atol(env) == 0)
+                use_numa = false;
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                arena_node[i] = -1;
+                arena_bindings[i] = 0;
+        }
+        next_arena = 0;
 
+        /* Small hot classes reuse the most recently freed block first;
+         * large classes keep address order for better coalescing. */
+        for (int j = 0; j < NUM_CLASSES; j++)
+                class_policy[j] = (j < NUM_SMALL_CLASSES) ?
+                    INSERT_LIFO : INSERT_ADDR;
+}
 
-/* 
+/*
  * Requires:
  *      None.
  *
@@ -97,216 +546,2228 @@ struct pointers* find_block(struct pointers* list, size_t asize);
  */
 
 int
-mm_init(void) 
-{         
-        // Create the heap with the exact size of the array free_lists.
-        if ((free_lists = (struct pointers*) mem_sbrk(NUM_SEGS * sizeof(struct pointers))) == (void *)-1)
+mm_init(void)
+{
+        const char *env;
+
+        init_runtime_config();
+
+        /* Create the heap with the exact size of the arena array. */
+        if ((arenas = (struct arena *)mem_sbrk(ALIGN(NUM_ARENAS *
+            sizeof(struct arena)))) == (void *)-1)
                 return (-1);
-        
-        // Initialize all the structurs in the lists to point to themself, to create a cycled list. 
-        for (int i = 0; i < NUM_SEGS; i++) {
-                free_lists[i].next = &free_lists[i]; 
-                free_lists[i].prev = &free_lists[i];    
+
+        /*
+         * Reserve one contiguous region per arena, back to back, dividing
+         * the rest of the reservation evenly across the arenas.
+         */
+        arena_region = (mem_sbrk_capacity() / NUM_ARENAS) &
+            ~(size_t)(CHUNKSIZE - 1);
+        if ((env = getenv("MM_ARENA_REGION")) != NULL && atol(env) > 0) {
+                size_t want = ((size_t)atol(env) + CHUNKSIZE - 1) &
+                    ~(size_t)(CHUNKSIZE - 1);
+
+                if (want < arena_region)
+                        arena_region = want;
         }
+        if (arena_region < ARENA_REGION_MIN)
+                return (-1);
+        if ((arena_base = (char *)mem_sbrk(NUM_ARENAS * arena_region)) ==
+            (char *)-1)
+                return (-1);
 
+        /*
+         * Ask for transparent huge pages over the whole reservation.  Heap
+         * walks touch one TLB entry per 2 MB instead of per 4 KB page; on
+         * multi-GB heaps that is most of the dTLB pressure.  Only the
+         * hugepage-aligned interior qualifies, and the call is advisory,
+         * so failure (old kernel, THP disabled) is simply ignored.
+         */
+        if (use_hugepages) {
+                uintptr_t lo = ((uintptr_t)arena_base + HUGEPAGE_SIZE - 1) &
+                    ~(uintptr_t)(HUGEPAGE_SIZE - 1);
+                uintptr_t hi = ((uintptr_t)arena_base +
+                    NUM_ARENAS * arena_region) &
+                    ~(uintptr_t)(HUGEPAGE_SIZE - 1);
+
+#ifdef MADV_HUGEPAGE
+                if (hi > lo)
+                        madvise((void *)lo, hi - lo, MADV_HUGEPAGE);
+#endif
+        }
 
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
+                char *base = arena_base + i * arena_region;
+
+                // Initialize all the structurs in the lists to point to themself, to create a cycled list.
+                for (int j = 0; j < NUM_CLASSES; j++) {
+                        a->free_lists[j].next = &a->free_lists[j];
+                        a->free_lists[j].prev = &a->free_lists[j];
+                        a->stats[j].searches = 0;
+                        a->stats[j].scanned = 0;
+                        a->stats[j].bailouts = 0;
+                        a->stats[j].allocs = 0;
+                        a->stats[j].frees = 0;
+                }
+                a->mallocs = 0;
+                a->frees = 0;
+                a->live_bytes = 0;
+                a->extends = 0;
+                a->splits = 0;
+                a->coalesces = 0;
+                a->madvises = 0;
+                a->returned_bytes = 0;
+                for (int j = 0; j < SEARCH_HIST_BUCKETS; j++)
+                        a->search_hist[j] = 0;
+                for (int j = 0; j < DIRTY_RING; j++)
+                        a->dirty_ring[j].bp = NULL;
+                a->dirty_head = 0;
+                a->check_cursor.bp = NULL;
+                a->remote_free = NULL;
+                for (int j = 0; j < NUM_CLASSES; j++)
+                        a->color_rr[j] = 0;
+                a->seg_map = 0;
+                a->big_root = NULL;
+                a->deferred = 0;
+                a->grow_size = growth_chunk;
+                pthread_mutex_init(&a->lock, NULL);
+
+                /* Create the initial empty heap inside the region. */
+                PUT(base + (0 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */
+                PUT(base + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */
+                PUT(base + (2 * WSIZE), PACK(0, 1));     /* Epilogue header */
+                SET_PREVALLOC(base + (2 * WSIZE));       /* Prologue is allocated */
+                a->heap_listp = base + WSIZE;            /* Needed for the heap checker */
+                a->brk = base + (3 * WSIZE);
+                a->limit = base + arena_region;
+
+                /* Extend the empty arena with a free block of CHUNKSIZE bytes. */
+                if (extend_heap(a, CHUNKSIZE / (WSIZE)) == NULL)
+                        return (-1);
+        }
 
-        /* Create the initial empty heap. */
-        if ((heap_listp = mem_sbrk(3 * WSIZE)) == (void *)-1)
-                return (-1);
+        /* Pre-extend the arenas if the footprint is known in advance.  A
+         * failed reservation is not fatal -- the arenas still grow on
+         * demand -- but silently ignoring it would hide a mis-sized knob,
+         * so warn. */
+        if ((env = getenv("MM_RESERVE")) != NULL && atol(env) > 0 &&
+            mm_reserve((size_t)atol(env)) != 0)
+                fprintf(stderr, "mm: MM_RESERVE=%s exceeds the heap\n", env);
 
-        PUT(heap_listp + (0 * WSIZE), PACK(DSIZE, 1)); /* Prologue header */ 
-        PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1)); /* Prologue footer */ 
-        PUT(heap_listp + (2 * WSIZE), PACK(0, 1));     /* Epilogue header */
-        heap_listp += (WSIZE);                         /* Needed for the heap checker */
+        return (0);
+}
 
-        /* Extend the empty heap with a free block of CHUNKSIZE bytes. */
-        if (extend_heap(CHUNKSIZE / (WSIZE)) == NULL)
-                return (-1);
-        
-        return (0);     
+/*
+ * Requires:
+ *      "policy" is INSERT_LIFO or INSERT_ADDR.
+ *
+ * Effects:
+ *      Sets the free list insertion policy for the size class that blocks
+ *      of block_size bytes map to.  Sizes below the minimum block size
+ *      (a caller thinking in payload sizes) clamp to the smallest class.
+ *      Takes effect for subsequent inserts; already-listed blocks keep
+ *      their position.
+ */
+void
+mm_set_insert_policy(size_t block_size, int policy)
+{
+        class_policy[size2class(MAX(ALIGN(block_size), MIN_BLOCK_SIZE))] =
+            (unsigned char)policy;
 }
 
-/* 
+/*
  * Requires:
- *      asize is an aligned size of bytes.
+ *      None.
  *
  * Effects:
- *      Based on the asize input, finds the apropriate free list and returns it's first node (head).
+ *      Pre-extends the arenas so that roughly "bytes" bytes of heap are
+ *      carved out and sitting in the free lists before the first request,
+ *      split evenly across arenas.  Returns 0 on success and -1 if any
+ *      arena's region could not supply its share.
  */
-struct pointers*
-get_free_list_head(size_t asize)
+int
+mm_reserve(size_t bytes)
 {
-        /* Find the index in the array, based on log(asize) / log(2). */
-        int num_segs = NUM_SEGS;
-        int idx = LOG2((int)(asize));
+        size_t per = ALIGN((bytes + NUM_ARENAS - 1) / NUM_ARENAS);
+        int error = 0;
 
-        idx = idx - 5;
-        /* If the index is beyond the scope of the array, return the last index in the array. */
-        if (idx >= num_segs) {
-                idx = num_segs - 1;
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
+
+                pthread_mutex_lock(&a->lock);
+                if (extend_heap(a, per / WSIZE) == NULL)
+                        error = -1;
+                pthread_mutex_unlock(&a->lock);
         }
-  
-        return &free_lists[idx];
+        return (error);
 }
 
-/* 
+/*
  * Requires:
- *      The given free list 'list' must have at least one block i.e list cannot point to itself.
+ *      "path" names a writable file.  The heap is quiescent: no other
+ *      thread is allocating or freeing, no other thread holds blocks
+ *      cached in its magazines, and no mmap'd blocks (MMAP_THRESHOLD and
+ *      up) or pool slabs the caller cannot rebuild are live.
  *
  * Effects:
- *      Returns a block from the given list if it's big enough to store a block of asize, otherwise returns NULL.
- *      If the list is too long, quits searching after a certain amount of iterations.   
+ *      Writes the arena array and every arena's used heap bytes to "path"
+ *      together with the addresses they occupy, as a sparse file.  The
+ *      calling thread's magazines are flushed and every arena's remote
+ *      free queue is drained first so the image holds no hidden
+ *      references.  Returns 0 on success and -1 on any I/O failure.
  */
-struct pointers*
-find_block(struct pointers* list, size_t asize)
+int
+mm_snapshot(const char *path)
 {
-        struct pointers *cur = list->next;
-        int iteration = 0;
-        do {
-                if (asize <= GET_SIZE(HDRP(cur))) // if the block is big enough, return it.
-                        return cur;
-                cur = cur->next;
-                if (iteration == 50)    // quit after 50 iteratoins.
-                        return (NULL);
-                iteration++;
-        } while (cur != list);
-        
-        /* No fit was found. */
-        return (NULL);
-} 
+        struct snap_header hdr;
+        uintptr_t base, end;
+        int fd, error = 0;
+
+        /* Blocks cached by this thread must be back in the free lists. */
+        flush_magazines(magazines);
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
+
+                pthread_mutex_lock(&a->lock);
+                drain_remote_frees(a);
+                pthread_mutex_unlock(&a->lock);
+        }
+
+        base = (uintptr_t)arenas & ~((uintptr_t)SNAP_HDR_SIZE - 1);
+        end = (uintptr_t)arena_base + NUM_ARENAS * arena_region;
+
+        hdr.magic = SNAP_MAGIC;
+        hdr.base = base;
+        hdr.length = end - base;
+        hdr.arenas_off = (uintptr_t)arenas - base;
+        hdr.arena_base_off = (uintptr_t)arena_base - base;
+        hdr.num_arenas = NUM_ARENAS;
+        hdr.arena_region = arena_region;
+        hdr.arena_size = sizeof(struct arena);
+
+        if ((fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0644)) < 0)
+                return (-1);
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr))
+                error = -1;
+
+        /* The arena array, including the free list heads the lists link
+         * back to.  Each byte lands at SNAP_HDR_SIZE plus its offset from
+         * "base", so the image can be mapped straight in. */
+        if (error == 0 &&
+            pwrite(fd, arenas, NUM_ARENAS * sizeof(struct arena),
+            (off_t)(SNAP_HDR_SIZE + ((uintptr_t)arenas - base))) < 0)
+                error = -1;
+
+        /* Each region up to its brk; the untouched tails stay holes. */
+        for (int i = 0; i < NUM_ARENAS && error == 0; i++) {
+                struct arena *a = &arenas[i];
+                char *rbase = arena_base + (size_t)i * arena_region;
+
+                if (pwrite(fd, rbase, (size_t)(a->brk - rbase),
+                    (off_t)(SNAP_HDR_SIZE + ((uintptr_t)rbase - base))) < 0)
+                        error = -1;
+        }
 
+        if (error == 0 &&
+            ftruncate(fd, (off_t)(SNAP_HDR_SIZE + hdr.length)) != 0)
+                error = -1;
+        if (close(fd) != 0)
+                error = -1;
+        return (error);
+}
 
-/* 
+/*
  * Requires:
- *      None.
+ *      "path" was written by mm_snapshot with the same build of this
+ *      allocator.  Neither mem_init, mm_init, nor any allocation has run
+ *      in this process, so the address range the snapshot occupied is
+ *      still free.
  *
  * Effects:
- *      Allocate a block with at least "size" bytes of payload, unless "size" is
- *      zero.  Returns the address of this block if the allocation was successful
- *      and NULL otherwise.
+ *      Maps the snapshot back at the address it was taken from, making
+ *      every free list pointer, treap link, and boundary tag in it valid
+ *      again, and reinitializes the per-process state that is not part of
+ *      the image: locks, remote free queues, checker state, and the
+ *      tuning normally read from the environment by mm_init.  The mapping
+ *      is private, so the snapshot file is never modified.  Returns 0 on
+ *      success and -1 if the file is unreadable, malformed, or its
+ *      address range is no longer available.
  */
-void *
-mm_malloc(size_t size)  
+int
+mm_init_from_snapshot(const char *path)
 {
-        size_t asize;           /* Adjusted block size. */
-        struct pointers *bp;    /* Initializing a pointer to a block. */
-        size_t extendsize;      /* Amount to extend heap if no fit. */ 
+        struct snap_header hdr;
+        void *mapped;
+        int fd;
 
-        /* Ignore spurious requests. */
-        if (size == 0)
-                return (NULL);
+        if ((fd = open(path, O_RDONLY)) < 0)
+                return (-1);
+        if (pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+            hdr.magic != SNAP_MAGIC ||
+            hdr.num_arenas != NUM_ARENAS ||
+            hdr.arena_region == 0 ||
+            hdr.arena_size != sizeof(struct arena)) {
+                close(fd);
+                return (-1);
+        }
 
-        /* Adjust block size to include overhead and alignment requests. */
-        if (size <= DSIZE) { 
-                asize = 2 * WSIZE + sizeof(struct pointers); 
-        } else {
-                asize = ALIGN(size);
-                asize = asize +  2 * WSIZE;
+        /*
+         * The image only works at its original address.  Refuse to map
+         * over whatever lives there now rather than clobbering it.
+         */
+#ifdef MAP_FIXED_NOREPLACE
+        mapped = mmap((void *)hdr.base, hdr.length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, SNAP_HDR_SIZE);
+#else
+        mapped = mmap((void *)hdr.base, hdr.length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE, fd, SNAP_HDR_SIZE);
+#endif
+        close(fd);
+        if (mapped == MAP_FAILED)
+                return (-1);
+        if (mapped != (void *)hdr.base) {
+                munmap(mapped, hdr.length);
+                return (-1);
         }
 
+        arenas = (struct arena *)((char *)mapped + hdr.arenas_off);
+        arena_base = (char *)mapped + hdr.arena_base_off;
+        arena_region = hdr.arena_region;
 
-        /* 
-         * Find the appropriate free list in the free_lists array,
-         * go to the next sized list until found,
-         * expands the heap if needed.
-         */
+        init_runtime_config();
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
 
-        if ((bp = find_fit(asize)) != NULL) {
-                place(bp, asize); 
-                return bp;
-        } 
-        
-        extendsize = MAX(asize, CHUNKSIZE); // Expend the heap as needed.
-        if ((bp = extend_heap(extendsize / WSIZE )) == NULL) {
-                return (NULL);
+                pthread_mutex_init(&a->lock, NULL);
+                a->remote_free = NULL;
+                a->check_cursor.bp = NULL;
+                a->dirty_head = 0;
+                for (int j = 0; j < DIRTY_RING; j++)
+                        a->dirty_ring[j].bp = NULL;
         }
+        return (0);
+}
 
-        place(bp, asize); // Place the block with it's appropriate size.
-        return (bp);  
-} 
-
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Returns the NUMA node the calling thread is running on, or -1 if
+ *      the kernel cannot say.
+ */
+static int
+current_node(void)
+{
+#ifdef SYS_getcpu
+        unsigned int cpu, node;
+
+        if (use_numa &&
+            syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+                return ((int)node);
+#endif
+        return (-1);
+}
 
 /*
  * Requires:
- *      asize is an alinged block size, including the overheads from the explicit, un-NULL list.
+ *      None.
  *
  * Effects:
- *      Finds if there is an available block of the correct size in a segragated free list and returns it, 
- *      otherwise returns NULL.
- *   
-*/
-struct pointers*
-find_fit(size_t asize) 
+ *      Returns the arena this thread is bound to, binding it round-robin
+ *      on the first call from this thread.
+ */
+static struct arena *
+bind_arena(void)
 {
-        struct pointers* block;
+        if (bound_arena == NULL) {
+                int node = current_node();
+                int idx = -1;
+
+                /*
+                 * Prefer an arena on this thread's NUMA node.  Claim an
+                 * unclaimed arena first, stamping it with the node; only
+                 * when every arena is claimed does the thread share the
+                 * least loaded one already stamped with its node.
+                 * Claiming first keeps threads spread across arenas -- on
+                 * a single-node machine a stamped-first scan would pile
+                 * every thread onto arena 0.  The stamp matters because
+                 * arena pages are placed by first touch -- the thread that
+                 * extends the arena's heap decides which node its pages
+                 * land on -- so keeping every later binding on the same
+                 * node keeps accesses local.
+                 */
+                if (node >= 0) {
+                        int best = -1;
+
+                        for (int i = 0; i < NUM_ARENAS; i++) {
+                                int unclaimed = -1;
+
+                                if (__atomic_compare_exchange_n(
+                                    &arena_node[i], &unclaimed, node,
+                                    false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED)) {
+                                        idx = i;
+                                        break;
+                                }
+                        }
 
-        // 1. Find the correct list.
-        int idx = LOG2((int)asize);
-        int num_segs = NUM_SEGS;
-        idx = idx - 5;  // Minimum block is 2^5
-        
-        if (idx >= num_segs ) {
-                idx = num_segs - 1; // Adjust index if it's larger than array length. 
-        }
-     
-        // 2. Iterate over lists to find a proper block.
-        for (; idx < num_segs; idx++) {
-                if (free_lists[idx].next != &free_lists[idx]) {     
-                        block = find_block(&free_lists[idx], asize);
-                        if (block != NULL) {
-                                return block;
+                        /* Other threads CAS-claim arenas and bump binding
+                         * counts concurrently; the scan only needs a
+                         * consistent-enough view, but the loads must be
+                         * atomic to be defined. */
+                        for (int i = 0; idx < 0 && i < NUM_ARENAS; i++) {
+                                if (__atomic_load_n(&arena_node[i],
+                                    __ATOMIC_RELAXED) != node)
+                                        continue;
+                                if (best < 0 ||
+                                    __atomic_load_n(&arena_bindings[i],
+                                    __ATOMIC_RELAXED) <
+                                    __atomic_load_n(&arena_bindings[best],
+                                    __ATOMIC_RELAXED))
+                                        best = i;
                         }
+                        if (idx < 0 && best >= 0)
+                                idx = best;
                 }
+
+                /* No node information or every arena claimed by other
+                 * nodes: fall back to round robin. */
+                if (idx < 0)
+                        idx = __atomic_fetch_add(&next_arena, 1,
+                            __ATOMIC_RELAXED) % NUM_ARENAS;
+
+                __atomic_add_fetch(&arena_bindings[idx], 1, __ATOMIC_RELAXED);
+                bound_arena = &arenas[idx];
         }
+        return (bound_arena);
+}
 
-        /* Did not find a proper block. */
-        return (NULL);
+/*
+ * Requires:
+ *      "bp" points into one of the arena regions.
+ *
+ * Effects:
+ *      Returns the arena that owns the address "bp".
+ */
+static struct arena *
+arena_of(void *bp)
+{
+        return (&arenas[((char *)bp - arena_base) / arena_region]);
 }
 
-/* 
+/*
  * Requires:
- *   "bp" is either the address of an allocated block or NULL.
+ *      "bp" is the payload address of an allocated block.
  *
  * Effects:
- *   Free and coalesce the block.
+ *      Returns true if the block lives outside the arena regions, i.e.
+ *      was served by mmap.  Pure address math: a cross-thread free can
+ *      classify a block without reading a header word the owning arena's
+ *      lock holder may be rewriting.
  */
-void
-mm_free(void *bp)
+static bool
+is_mmapped_addr(void *bp)
 {
-        size_t size;
 
-        /* Ignore spurious requests. */
-        if (bp == NULL)
-                return;
-        
-        /* Free and coalesce the block. */
-        size = GET_SIZE(HDRP(bp));
-        PUT(HDRP(bp), PACK(size, 0));
-        PUT(FTRP(bp), PACK(size, 0));
-        coalesce(bp);
+        return ((char *)bp < arena_base ||
+            (char *)bp >= arena_base + NUM_ARENAS * arena_region);
 }
 
 /*
  * Requires:
- *   "ptr" is either the address of an allocated block or NULL.
+ *      The caller holds a's lock.
  *
  * Effects:
- *   Reallocates the block "ptr" to a block with at least "size" bytes of
- *   payload, unless "size" is zero.  If "size" is zero, frees the block
- *   "ptr" and returns NULL.  If the block "ptr" is already a block with at
- *   least "size" bytes of payload, then "ptr" may optionally be returned.
- *   Otherwise, a new block is allocated and the contents of the old block
- *   "ptr" are copied to that new block.  Returns the address of this new
- *   block if the allocation was successful and NULL otherwise.
+ *      Extends arena a's heap by "incr" bytes within its reserved region.
+ *      Returns the old break on success and (void *)-1 if the region is full.
  */
-void *
-mm_realloc(void *ptr, size_t size)
+static void *
+arena_sbrk(struct arena *a, size_t incr)
 {
-        size_t oldsize = GET_SIZE(HDRP(ptr));
+        char *old_brk = a->brk;
+
+        if (a->brk + incr > a->limit)
+                return ((void *)-1);
+        a->brk += incr;
+        return (old_brk);
+}
+
+/*
+ * Requires:
+ *      "bp" is the address of a free block.
+ *
+ * Effects:
+ *      Returns a pseudo-random priority derived from the block address.
+ */
+static uint32_t
+treap_priority(void *bp)
+{
+        uintptr_t x = (uintptr_t)bp;
+
+        x ^= x >> 17;
+        x *= 0x9E3779B1u;
+        x ^= x >> 13;
+        return ((uint32_t)x);
+}
+
+/*
+ * Requires:
+ *      "x" and "y" are nodes overlaid on free blocks.
+ *
+ * Effects:
+ *      Orders nodes by (size, address), so every key is unique.
+ */
+static bool
+treap_key_less(struct treap_node *x, struct treap_node *y)
+{
+        size_t xs = GET_SIZE(HDRP(x));
+        size_t ys = GET_SIZE(HDRP(y));
+
+        if (xs != ys)
+                return (xs < ys);
+        return (x < y);
+}
+
+/*
+ * Requires:
+ *      "node" is not in the treap rooted at "root".
+ *
+ * Effects:
+ *      Inserts "node" and returns the new root.
+ */
+static struct treap_node *
+treap_insert(struct treap_node *root, struct treap_node *node)
+{
+        if (root == NULL) {
+                node->left = NULL;
+                node->right = NULL;
+                return (node);
+        }
+        if (treap_key_less(node, root)) {
+                root->left = treap_insert(root->left, node);
+                if (root->left->priority > root->priority) {
+                        /* Rotate right to restore the heap order. */
+                        struct treap_node *l = root->left;
+                        root->left = l->right;
+                        l->right = root;
+                        root = l;
+                }
+        } else {
+                root->right = treap_insert(root->right, node);
+                if (root->right->priority > root->priority) {
+                        /* Rotate left to restore the heap order. */
+                        struct treap_node *r = root->right;
+                        root->right = r->left;
+                        r->left = root;
+                        root = r;
+                }
+        }
+        return (root);
+}
+
+/*
+ * Requires:
+ *      "l" and "r" are treaps where every key in l is less than every key in r.
+ *
+ * Effects:
+ *      Merges the two treaps and returns the root.
+ */
+static struct treap_node *
+treap_merge(struct treap_node *l, struct treap_node *r)
+{
+        if (l == NULL)
+                return (r);
+        if (r == NULL)
+                return (l);
+        if (l->priority > r->priority) {
+                l->right = treap_merge(l->right, r);
+                return (l);
+        }
+        r->left = treap_merge(l, r->left);
+        return (r);
+}
+
+/*
+ * Requires:
+ *      "node" is in the treap rooted at "root".
+ *
+ * Effects:
+ *      Removes "node" and returns the new root.
+ */
+static struct treap_node *
+treap_remove(struct treap_node *root, struct treap_node *node)
+{
+        if (root == NULL)
+                return (NULL);
+        if (root == node)
+                return (treap_merge(root->left, root->right));
+        if (treap_key_less(node, root))
+                root->left = treap_remove(root->left, node);
+        else
+                root->right = treap_remove(root->right, node);
+        return (root);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned block size.
+ *
+ * Effects:
+ *      Returns the smallest block of at least asize bytes in the treap,
+ *      or NULL if no block fits.  O(log n) expected.
+ */
+static struct treap_node *
+treap_find(struct treap_node *root, size_t asize)
+{
+        struct treap_node *best = NULL;
+
+        while (root != NULL) {
+                if (GET_SIZE(HDRP(root)) >= asize) {
+                        best = root;       // Fits; look for a tighter one.
+                        root = root->left;
+                } else
+                        root = root->right;
+        }
+        return (best);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned size of at least MIN_BLOCK_SIZE bytes.
+ *
+ * Effects:
+ *      Returns the size-class index for a block of asize bytes: exact
+ *      classes below SMALL_CLASS_MAX, doubling classes above, clamped to
+ *      the catch-all last class.
+ */
+static int
+size2class(size_t asize)
+{
+        int idx;
+
+        if (asize <= SMALL_CLASS_MAX)
+                return ((int)((asize - MIN_BLOCK_SIZE) / ALIGNMENT));
+
+        idx = NUM_SMALL_CLASSES + (LOG2((int)asize) - SMALL_CLASS_LOG);
+        /* If the index is beyond the scope of the array, return the last index in the array. */
+        if (idx >= NUM_CLASSES) {
+                idx = NUM_CLASSES - 1;
+        }
+        return (idx);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned size of bytes.
+ *
+ * Effects:
+ *      Based on the asize input, finds the apropriate free list in arena a
+ *      and returns it's first node (head).
+ */
+struct pointers*
+get_free_list_head(struct arena *a, size_t asize)
+{
+        return &a->free_lists[size2class(asize)];
+}
+
+/*
+ * Requires:
+ *      idx is a valid class index in arena a, and the caller holds a's lock.
+ *
+ * Effects:
+ *      Returns the tightest fitting block of at least asize bytes found
+ *      within the first SEARCH_BOUND blocks of class idx, or NULL if none
+ *      fits.  An exact fit returns immediately.  Updates the class's search
+ *      statistics.
+ */
+struct pointers*
+find_block(struct arena *a, int idx, size_t asize)
+{
+        struct pointers *list = &a->free_lists[idx];
+        struct pointers *cur = list->next;
+        struct pointers *best = NULL;   // Tightest fit seen so far.
+        size_t best_size = 0;
+        int iteration = 0;
+
+        a->stats[idx].searches++;
+
+        while (cur != list) {
+                struct pointers *next = cur->next;
+                size_t csize;
+
+                /*
+                 * On a fragmented list every step is a dependent cache
+                 * miss.  Issue the next node's miss now, so it overlaps
+                 * with this node's fit check instead of following it.
+                 * Prefetching the header line also covers the link words:
+                 * the header sits one word below the node, so the two
+                 * share a line unless the node starts one.
+                 */
+                if (next != list)
+                        __builtin_prefetch(HDRP(next));
+
+                csize = GET_SIZE(HDRP(cur));
+                iteration++;
+
+                if (csize == asize) {   // An exact fit cannot be beaten.
+                        a->stats[idx].scanned += iteration;
+                        return (cur);
+                }
+                if (asize <= csize && (best == NULL || csize < best_size)) {
+                        best = cur;
+                        best_size = csize;
+                }
+                if (iteration == SEARCH_BOUND) {   // Bound the walk; keep the best fit seen.
+                        a->stats[idx].bailouts++;
+                        break;
+                }
+                cur = next;
+        }
+
+        a->stats[idx].scanned += iteration;
+        if (iteration > 0) {
+                int bucket = LOG2(iteration);
+                if (bucket >= SEARCH_HIST_BUCKETS)
+                        bucket = SEARCH_HIST_BUCKETS - 1;
+                a->search_hist[bucket]++;
+        }
+        return (best);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned block size.
+ *
+ * Effects:
+ *      Allocates a block of asize bytes from arena a, extending the arena's
+ *      heap if needed.  Returns the block, or NULL if the arena's region
+ *      cannot satisfy the request.
+ */
+static void *
+arena_malloc(struct arena *a, size_t asize)
+{
+        struct pointers *bp;
+        size_t extendsize;
+
+        pthread_mutex_lock(&a->lock);
+
+        /* Frees pushed by other threads are merged in before searching. */
+        drain_remote_frees(a);
+
+        if ((bp = find_fit(a, asize)) != NULL) {
+                place(a, bp, asize);
+                a->mallocs++;
+                a->stats[size2class(asize)].allocs++;
+                pthread_mutex_unlock(&a->lock);
+                return (bp);
+        }
+
+        /*
+         * Before growing the heap, merge any frees deferred in this arena
+         * and retry; a batched coalesce may produce a block big enough.
+         */
+        if (a->deferred > 0) {
+                coalesce_arena(a);
+                if ((bp = find_fit(a, asize)) != NULL) {
+                        place(a, bp, asize);
+                        a->mallocs++;
+                        a->stats[size2class(asize)].allocs++;
+                        pthread_mutex_unlock(&a->lock);
+                        return (bp);
+                }
+        }
+
+        extendsize = MAX(asize, a->grow_size); // Expend the heap as needed.
+        if ((bp = (struct pointers *)extend_heap(a, extendsize / WSIZE)) != NULL) {
+                /* Geometric growth: double the next extension up to the cap. */
+                if (a->grow_size < growth_max)
+                        a->grow_size = MIN(a->grow_size * 2, growth_max);
+                place(a, bp, asize); // Place the block with it's appropriate size.
+                a->mallocs++;
+                a->stats[size2class(asize)].allocs++;
+                pthread_mutex_unlock(&a->lock);
+                return (bp);
+        }
+
+        pthread_mutex_unlock(&a->lock);
+        return (NULL);
+}
+
+
+/*
+ * Requires:
+ *      asize is an aligned block size.
+ *
+ * Effects:
+ *      Allocates a block of asize bytes from arena a, searching for a free
+ *      block big enough that place() leaves a free remainder of at least
+ *      growable_headroom bytes directly after it.  That remainder goes
+ *      back into the free lists as usual, so every invariant holds; it
+ *      just makes mm_realloc's next-block-free in-place path succeed
+ *      until something else claims it.  Returns the block, or NULL.
+ */
+static void *
+arena_malloc_headroom(struct arena *a, size_t asize)
+{
+        struct pointers *bp;
+        size_t extendsize, wsize;
+
+        wsize = asize + ALIGN(growable_headroom) + MIN_BLOCK_SIZE;
+
+        pthread_mutex_lock(&a->lock);
+        drain_remote_frees(a);
+
+        if ((bp = find_fit(a, wsize)) == NULL && a->deferred > 0) {
+                coalesce_arena(a);
+                bp = find_fit(a, wsize);
+        }
+        if (bp == NULL) {
+                extendsize = MAX(wsize, a->grow_size);
+                if ((bp = (struct pointers *)extend_heap(a,
+                    extendsize / WSIZE)) == NULL) {
+                        pthread_mutex_unlock(&a->lock);
+                        return (NULL);
+                }
+                if (a->grow_size < growth_max)
+                        a->grow_size = MIN(a->grow_size * 2, growth_max);
+        }
+
+        /* The found block exceeds asize by at least the headroom, so
+         * place() always splits and the tail lands after the block. */
+        place(a, bp, asize);
+        a->mallocs++;
+        a->stats[size2class(asize)].allocs++;
+        pthread_mutex_unlock(&a->lock);
+        return (bp);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned block size, count is nonzero, and "out" has
+ *      room for count pointers.
+ *
+ * Effects:
+ *      Allocates count blocks of asize bytes each from arena a by carving
+ *      one free block of count * asize bytes in a single pass: one fit
+ *      search, one list removal, and count header writes.  A tail
+ *      remainder below the minimum block size is absorbed into the last
+ *      block; a larger one goes back to the free lists.  Fills out[] and
+ *      returns 0, or returns -1 if the arena cannot supply the run.
+ */
+static int
+arena_malloc_batch(struct arena *a, size_t asize, size_t count, void **out)
+{
+        struct pointers *bp;
+        size_t csize, extendsize, rest, total;
+        uintptr_t prevbit;
+        char *p;
+
+        total = asize * count;
+
+        pthread_mutex_lock(&a->lock);
+        drain_remote_frees(a);
+
+        if ((bp = find_fit(a, total)) == NULL && a->deferred > 0) {
+                coalesce_arena(a);
+                bp = find_fit(a, total);
+        }
+        if (bp == NULL) {
+                extendsize = MAX(total, a->grow_size);
+                if ((bp = (struct pointers *)extend_heap(a,
+                    extendsize / WSIZE)) == NULL) {
+                        pthread_mutex_unlock(&a->lock);
+                        return (-1);
+                }
+                if (a->grow_size < growth_max)
+                        a->grow_size = MIN(a->grow_size * 2, growth_max);
+        }
+
+        csize = GET_SIZE(HDRP(bp));
+        rest = csize - total;
+        removeNode(a, bp);
+
+        /* Carve the run: each block's header marks its predecessor
+         * allocated, so only the first inherits the old prev bit. */
+        p = (char *)bp;
+        prevbit = GET_PREVALLOC(HDRP(p));
+        for (size_t i = 0; i < count; i++) {
+                size_t bsize = asize;
+
+                if (i == count - 1 && rest < MIN_BLOCK_SIZE) {
+                        bsize += rest;
+                        rest = 0;
+                }
+                PUT(HDRP(p), PACK(bsize, 1) | prevbit);
+                out[i] = p;
+                prevbit = 0x2;
+                p += bsize;
+        }
+
+        if (rest > 0) {
+                /* The tail remainder becomes an ordinary free block. */
+                PUT(HDRP(p), PACK(rest, 0));
+                SET_PREVALLOC(HDRP(p));
+                PUT(FTRP(p), PACK(rest, 0));
+                insertNode(a, (struct pointers *)p);
+                a->splits++;
+        } else
+                SET_PREVALLOC(HDRP(p));
+
+        a->live_bytes += csize - rest;
+        a->mallocs += count;
+        a->stats[size2class(asize)].allocs += count;
+        mark_dirty(a, out[count - 1]);
+
+        pthread_mutex_unlock(&a->lock);
+        return (0);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned block size, alignment is a power of two larger
+ *      than ALIGNMENT, and off is the payload's offset within the block.
+ *
+ * Effects:
+ *      Allocates a block of asize bytes from arena a whose payload address
+ *      plus "off" is a multiple of "alignment", extending the arena's heap
+ *      if needed.  Returns the block, or NULL if the arena's region cannot
+ *      satisfy the request.
+ */
+static void *
+arena_memalign(struct arena *a, size_t asize, size_t alignment, size_t off)
+{
+        struct pointers *bp;
+        size_t extendsize, slop, wsize;
+        char *aligned, *p;
+
+        /*
+         * Search for a block big enough that some aligned position inside
+         * it fits asize: in the worst case the aligned payload sits almost
+         * one alignment plus one minimum block past the block start.
+         */
+        wsize = asize + alignment + MIN_BLOCK_SIZE;
+
+        pthread_mutex_lock(&a->lock);
+        drain_remote_frees(a);
+
+        if ((bp = find_fit(a, wsize)) == NULL && a->deferred > 0) {
+                coalesce_arena(a);
+                bp = find_fit(a, wsize);
+        }
+        if (bp == NULL) {
+                extendsize = MAX(wsize, a->grow_size);
+                if ((bp = (struct pointers *)extend_heap(a,
+                    extendsize / WSIZE)) == NULL) {
+                        pthread_mutex_unlock(&a->lock);
+                        return (NULL);
+                }
+                if (a->grow_size < growth_max)
+                        a->grow_size = MIN(a->grow_size * 2, growth_max);
+        }
+
+        /*
+         * Carve the leading slop off the free block so the payload lands on
+         * the alignment boundary.  The slop must itself be a whole block,
+         * so if the boundary is too close, step to the next one.
+         */
+        p = (char *)bp;
+        aligned = (char *)(((uintptr_t)p + off + alignment - 1) &
+            ~(uintptr_t)(alignment - 1)) - off;
+        while (aligned != p && (size_t)(aligned - p) < MIN_BLOCK_SIZE)
+                aligned += alignment;
+        slop = (size_t)(aligned - p);
+        if (slop > 0) {
+                size_t csize = GET_SIZE(HDRP(p));
+
+                removeNode(a, bp);
+
+                /* The slop becomes its own free block. */
+                PUT(HDRP(p), PACK(slop, 0) | GET_PREVALLOC(HDRP(p)));
+                PUT(FTRP(p), PACK(slop, 0));
+                insertNode(a, (struct pointers *)p);
+
+                /* The rest is a free block starting at the aligned spot. */
+                PUT(HDRP(aligned), PACK(csize - slop, 0));
+                PUT(FTRP(aligned), PACK(csize - slop, 0));
+                insertNode(a, (struct pointers *)aligned);
+
+                bp = (struct pointers *)aligned;
+        }
+
+        /* From here on this is an ordinary allocation. */
+        place(a, bp, asize);
+        a->mallocs++;
+        a->stats[size2class(asize)].allocs++;
+        pthread_mutex_unlock(&a->lock);
+        return (bp);
+}
+
+/*
+ * Requires:
+ *      asize is an aligned block size.
+ *
+ * Effects:
+ *      Returns the magazine bin index for a block of asize bytes, or -1 if
+ *      blocks of that size are not cached in magazines.
+ */
+static int
+mag_bin(size_t asize)
+{
+        if (asize > MAG_MAX_ASIZE)
+                return (-1);
+        return ((int)((asize - MAG_MIN_ASIZE) / ALIGNMENT));
+}
+
+/*
+ * Requires:
+ *      "arg" is a thread's magazine array.
+ *
+ * Effects:
+ *      Returns every cached block to the free lists of its owning arena.
+ *      Runs as the mag_key destructor when a thread exits, and directly
+ *      for the calling thread when mm_snapshot quiesces the heap.
+ */
+static void
+flush_magazines(void *arg)
+{
+        struct magazine *mags = arg;
+
+        for (int i = 0; i < NUM_MAG_BINS; i++)
+                while (mags[i].count > 0)
+                        free_to_arena(mags[i].blocks[--mags[i].count]);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Creates the thread-exit key for the magazines, once per process.
+ */
+static void
+mag_key_init(void)
+{
+
+        pthread_key_create(&mag_key, flush_magazines);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      qsort comparator ordering pointers by address.
+ */
+static int
+addr_cmp(const void *x, const void *y)
+{
+        uintptr_t a = (uintptr_t)*(void * const *)x;
+        uintptr_t b = (uintptr_t)*(void * const *)y;
+
+        return (a < b ? -1 : (a > b ? 1 : 0));
+}
+
+/*
+ * Requires:
+ *      "bp" is the address of an allocated block.
+ *
+ * Effects:
+ *      Marks "bp" free and coalesces it into the arena that owns it.
+ */
+static void
+free_to_arena(void *bp)
+{
+        struct arena *a;
+
+        /* Route the block back to the arena that owns its address. */
+        a = arena_of(bp);
+
+        /*
+         * A cross-thread free would contend on the owner's lock; push the
+         * still-allocated block onto the owner's remote-free stack with a
+         * CAS instead.  The owner drains the stack before its next fit
+         * search, so removeNode/insertNode/coalesce stay effectively
+         * single-threaded per arena and the freeing thread never waits.
+         */
+        if (a != bound_arena) {
+                remote_free_push(a, bp);
+                return;
+        }
+
+        pthread_mutex_lock(&a->lock);
+        free_block_locked(a, bp);
+        pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * Requires:
+ *      "bp" is an allocated block in arena a, and the caller holds a's
+ *      lock.
+ *
+ * Effects:
+ *      Marks "bp" free, updates the counters, and inserts or coalesces it.
+ */
+static void
+free_block_locked(struct arena *a, void *bp)
+{
+        size_t size;
+
+        /* Free the block, keeping the prev-allocated bit. */
+        size = GET_SIZE(HDRP(bp));
+        PUT(HDRP(bp), PACK(size, 0) | GET_PREVALLOC(HDRP(bp)));
+        PUT(FTRP(bp), PACK(size, 0));
+        a->frees++;
+        a->live_bytes -= size;
+        a->stats[size2class(size)].frees++;
+
+        /*
+         * In deferred mode just insert the block; neighbors are merged in a
+         * batch by coalesce_arena once a fit search fails.
+         */
+        if (defer_coalescing) {
+                insertNode(a, (struct pointers *)bp);
+                CLR_PREVALLOC(HDRP(NEXT_BLKP(bp)));
+                a->deferred++;
+        } else
+                coalesce(a, bp);
+}
+
+/*
+ * Requires:
+ *      "bp" is an allocated block in arena a.
+ *
+ * Effects:
+ *      Pushes "bp" onto arena a's remote-free stack.  The block stays
+ *      marked allocated; its first payload word carries the stack link.
+ *      Wait-free for the pushing thread apart from CAS retries.
+ */
+static void
+remote_free_push(struct arena *a, void *bp)
+{
+        void *old = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+
+        do {
+                *(void **)bp = old;
+        } while (!__atomic_compare_exchange_n(&a->remote_free, &old, bp,
+            true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        COUNT_ADD(remote_free_pushes, 1);
+}
+
+/*
+ * Requires:
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Takes the whole remote-free stack in one exchange and frees every
+ *      block on it.  The lock serializes drains, so multiple producers
+ *      with one consumer at a time is all the stack has to support.
+ */
+static void
+drain_remote_frees(struct arena *a)
+{
+        void *bp, *next;
+
+        if (__atomic_load_n(&a->remote_free, __ATOMIC_RELAXED) == NULL)
+                return;
+        bp = __atomic_exchange_n(&a->remote_free, NULL, __ATOMIC_ACQUIRE);
+        while (bp != NULL) {
+                next = *(void **)bp;
+                free_block_locked(a, bp);
+                bp = next;
+        }
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block of at least "size" payload bytes directly from the
+ *      kernel with mmap, bypassing the arenas.  Returns the block, or NULL
+ *      if the mapping failed.
+ */
+static void *
+mmap_malloc(size_t size)
+{
+        size_t pagesize = mem_pagesize();
+        size_t msize;
+        char *map;
+
+        /* Round the header plus payload up to whole pages. */
+        msize = (size + WSIZE + pagesize - 1) & ~(pagesize - 1);
+
+        map = MAP_FAILED;
+
+        /*
+         * Mappings of a huge page or more are rounded up and tried as
+         * explicit huge pages first; that fails unless hugetlb pages are
+         * reserved, so fall back to a normal mapping plus THP advice.
+         */
+        if (use_hugepages && msize >= HUGEPAGE_SIZE) {
+                size_t hsize = (msize + HUGEPAGE_SIZE - 1) &
+                    ~(size_t)(HUGEPAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+                map = mmap(NULL, hsize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+                if (map != MAP_FAILED)
+                        msize = hsize;
+        }
+        if (map == MAP_FAILED) {
+                map = mmap(NULL, msize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (map == MAP_FAILED)
+                        return (NULL);
+#ifdef MADV_HUGEPAGE
+                if (use_hugepages && msize >= HUGEPAGE_SIZE)
+                        madvise(map, msize, MADV_HUGEPAGE);
+#endif
+        }
+
+        /* The header records the mapping size and the mmapped bit. */
+        PUT(map, PACK(msize, 1) | 0x4);
+        COUNT_ADD(mmap_allocs, 1);
+        COUNT_ADD(mmap_bytes, msize);
+        return (map + WSIZE);
+}
+
+#ifdef MM_PROFILE
+/*
+ * Allocation-site sampling profiler, compiled in with -DMM_PROFILE and
+ * meant to be cheap enough to leave on in production: every
+ * MM_PROFILE_RATEth allocation per thread records its requested size,
+ * size class, and a shallow backtrace into a fixed ring.  The ring is
+ * preallocated -- the profiler never allocates -- and writers claim slots
+ * with one atomic add, so the steady-state cost is a thread-local
+ * decrement.
+ */
+#include <execinfo.h>
+
+#ifndef MM_PROFILE_RATE
+#define MM_PROFILE_RATE 4096    /* Sample every Nth allocation */
+#endif
+#define PROFILE_RING 1024       /* Samples kept; older ones overwritten */
+
+static struct mm_profile_sample profile_ring[PROFILE_RING];
+static uint64_t profile_pos;
+static __thread unsigned profile_countdown;
+
+/*
+ * Requires:
+ *      asize is the adjusted block size for a request of "size" bytes.
+ *
+ * Effects:
+ *      Records one sample in the ring.
+ */
+static void
+profile_record(size_t size, size_t asize)
+{
+        uint64_t i = COUNT_ADD(profile_pos, 1) - 1;
+        struct mm_profile_sample *smp = &profile_ring[i % PROFILE_RING];
+
+        smp->size = size;
+        smp->class_idx = size2class(asize);
+        memset(smp->stack, 0, sizeof(smp->stack));
+        backtrace(smp->stack, MM_PROFILE_DEPTH);
+}
+
+/*
+ * Requires:
+ *      "out" has room for "max" samples.
+ *
+ * Effects:
+ *      Copies up to "max" of the most recently recorded samples into
+ *      "out" and returns how many were copied.  The copy is a racy
+ *      snapshot: samples recorded concurrently may be torn, which is
+ *      acceptable for attribution of heap growth over time.
+ */
+size_t
+mm_profile_dump(struct mm_profile_sample *out, size_t max)
+{
+        uint64_t pos = __atomic_load_n(&profile_pos, __ATOMIC_RELAXED);
+        size_t filled = (size_t)MIN(pos, (uint64_t)PROFILE_RING);
+        size_t n = MIN(filled, max);
+
+        for (size_t i = 0; i < n; i++)
+                out[i] = profile_ring[(pos - n + i) % PROFILE_RING];
+        return (n);
+}
+#endif /* MM_PROFILE */
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocate a block with at least "size" bytes of payload, unless "size" is
+ *      zero.  Returns the address of this block if the allocation was successful
+ *      and NULL otherwise.  This is the whole allocation path; mm_malloc is a
+ *      thin wrapper that only adds guards in debug builds.
+ */
+static void *
+malloc_core(size_t size)
+{
+        size_t asize;           /* Adjusted block size. */
+        struct arena *a;        /* Arena this thread is bound to. */
+        void *bp;
+
+        /* Ignore spurious requests. */
+        if (size == 0)
+                return (NULL);
+
+        /*
+         * Adjust block size to include overhead and alignment requests.
+         * Allocated blocks carry only a header word; the minimum block size
+         * still leaves room for the footer and list pointers a free block
+         * needs.
+         */
+        asize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+
+#ifdef MM_PROFILE
+        /* Sampled allocation-site profiling; see profile_record. */
+        if (profile_countdown-- == 0) {
+                profile_countdown = MM_PROFILE_RATE - 1;
+                profile_record(size, asize);
+        }
+#endif
+
+        /*
+         * Large requests go straight to the kernel so they neither fragment
+         * the arena regions nor linger in the free lists after free.  If the
+         * mapping fails, fall through to the arena path.
+         */
+        if (asize >= MMAP_THRESHOLD) {
+                if ((bp = mmap_malloc(size)) != NULL)
+                        return (bp);
+        }
+
+        /*
+         * Small sizes: pop a cached block off this thread's magazine.
+         * The cached block is still marked allocated with the exact same
+         * size, so there is nothing else to do.
+         */
+        int bin = mag_bin(asize);
+        if (bin >= 0 && magazines[bin].count > 0) {
+                COUNT_ADD(mag_alloc_hits, 1);
+                return (magazines[bin].blocks[--magazines[bin].count]);
+        }
+
+        /*
+         * Try the arena this thread is bound to first.  If its region is
+         * exhausted, fall back to the other arenas before failing.
+         */
+        a = bind_arena();
+        if ((bp = arena_malloc(a, asize)) != NULL)
+                return (bp);
+
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                if (&arenas[i] == a)
+                        continue;
+                if ((bp = arena_malloc(&arenas[i], asize)) != NULL)
+                        return (bp);
+        }
+
+        return (NULL);
+}
+
+#ifdef MM_GUARDS
+/*
+ * Requires:
+ *      "bp" is a block with room for "req" payload bytes plus both guards.
+ *
+ * Effects:
+ *      Arms the canaries around the payload and returns the payload
+ *      address handed to the caller.
+ */
+static void *
+guard_arm(void *bp, size_t req)
+{
+        char *p = (char *)bp + WSIZE;
+        uint64_t tail = GUARD_TAIL_MAGIC ^ (uint64_t)req;
+
+        PUT(bp, (uintptr_t)req ^ GUARD_FRONT_MAGIC);
+        memcpy(p + req, &tail, sizeof(tail));   /* May be unaligned. */
+        return (p);
+}
+
+/*
+ * Requires:
+ *      "p" is a payload pointer previously returned by a guarded call.
+ *
+ * Effects:
+ *      Validates both canaries, aborting loudly on a mismatch (overrun,
+ *      underrun, double free, or foreign pointer).  Returns the inner
+ *      block pointer and stores the requested size through "req_out".
+ */
+static void *
+guard_check(void *p, size_t *req_out)
+{
+        void *bp = (char *)p - WSIZE;
+        size_t req = (size_t)(GET(bp) ^ GUARD_FRONT_MAGIC);
+        uint64_t tail;
+
+        if (req > GET_SIZE(HDRP(bp))) {
+                fprintf(stderr, "mm: bad front guard at %p (double free?)\n", p);
+                abort();
+        }
+        memcpy(&tail, (char *)p + req, sizeof(tail));
+        if (tail != (GUARD_TAIL_MAGIC ^ (uint64_t)req)) {
+                fprintf(stderr, "mm: overrun past %p + %zu\n", p, req);
+                abort();
+        }
+        *req_out = req;
+        return (bp);
+}
+#endif /* MM_GUARDS */
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocate a block with at least "size" bytes of payload, unless "size" is
+ *      zero.  Returns the address of this block if the allocation was successful
+ *      and NULL otherwise.
+ */
+void *
+mm_malloc(size_t size)
+{
+#ifdef MM_GUARDS
+        void *bp;
+
+        if (size == 0)
+                return (NULL);
+        /* Room for the front guard word and the tail canary. */
+        if ((bp = malloc_core(size + 2 * WSIZE)) == NULL)
+                return (NULL);
+        return (guard_arm(bp, size));
+#else
+        return (malloc_core(size));
+#endif
+}
+
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block with at least "size" bytes of payload whose
+ *      address is a multiple of "alignment".  This is the whole aligned
+ *      allocation path; mm_memalign is a thin wrapper that only adds
+ *      guards in debug builds.  Aligned blocks always come from the
+ *      arenas -- they skip the magazines (cached blocks have arbitrary
+ *      addresses) and the mmap path -- and are ordinary blocks
+ *      afterwards, so mm_free and mm_realloc work on them unmodified.
+ */
+static void *
+memalign_core(size_t alignment, size_t size, size_t off)
+{
+        size_t asize;           /* Adjusted block size. */
+        struct arena *a;        /* Arena this thread is bound to. */
+        void *bp;
+
+        /* Ignore spurious requests. */
+        if (size == 0)
+                return (NULL);
+
+        asize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+
+        a = bind_arena();
+        if ((bp = arena_memalign(a, asize, alignment, off)) != NULL)
+                return (bp);
+
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                if (&arenas[i] == a)
+                        continue;
+                if ((bp = arena_memalign(&arenas[i], asize, alignment,
+                    off)) != NULL)
+                        return (bp);
+        }
+
+        return (NULL);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block with at least "size" bytes of payload, arranged
+ *      so the block has room to grow: a free block of at least
+ *      growable_headroom bytes is left right after it.  This is the whole
+ *      growable path; mm_malloc_growable only adds guards in debug
+ *      builds.  Growable blocks skip the magazines and the mmap path and
+ *      fall back to the plain allocation path when no block with
+ *      headroom can be found.
+ */
+static void *
+growable_core(size_t size)
+{
+        size_t asize;           /* Adjusted block size. */
+        struct arena *a;        /* Arena this thread is bound to. */
+        void *bp;
+
+        /* Ignore spurious requests. */
+        if (size == 0)
+                return (NULL);
+
+        asize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+
+        a = bind_arena();
+        if ((bp = arena_malloc_headroom(a, asize)) != NULL)
+                return (bp);
+
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                if (&arenas[i] == a)
+                        continue;
+                if ((bp = arena_malloc_headroom(&arenas[i], asize)) != NULL)
+                        return (bp);
+        }
+
+        /* No room for the headroom anywhere: a plain block beats NULL. */
+        return (malloc_core(size));
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block for append-heavy callers that expect to
+ *      mm_realloc it larger many times, such as log buffers.  The block
+ *      is placed with a free tail of at least growable_headroom bytes
+ *      after it, so growing reallocs hit the in-place merge path --
+ *      an O(1) header rewrite -- instead of allocate-copy-free, until
+ *      the headroom is used up or claimed by another allocation.
+ *      Returns the block, or NULL on failure.
+ */
+void *
+mm_malloc_growable(size_t size)
+{
+#ifdef MM_GUARDS
+        void *bp;
+
+        if (size == 0)
+                return (NULL);
+        /* Room for the front guard word and the tail canary. */
+        if ((bp = growable_core(size + 2 * WSIZE)) == NULL)
+                return (NULL);
+        return (guard_arm(bp, size));
+#else
+        return (growable_core(size));
+#endif
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Sets the free tail, in bytes, that mm_malloc_growable leaves after
+ *      the blocks it allocates.
+ */
+void
+mm_set_growable_headroom(size_t bytes)
+{
+        growable_headroom = bytes;
+}
+
+/*
+ * Requires:
+ *      "block_size" is a size handled by one of the list classes.
+ *
+ * Effects:
+ *      Turns cache-line coloring on or off for the class serving blocks
+ *      of "block_size" bytes.  Coloring trades some of the split slack
+ *      for fewer L1 set conflicts and no false sharing between a block's
+ *      payload and its neighbor's header; worth it only for hot,
+ *      latency-sensitive classes.  Sizes below the minimum block size
+ *      clamp to the smallest class.
+ */
+void
+mm_set_class_coloring(size_t block_size, bool on)
+{
+        class_colored[size2class(MAX(ALIGN(block_size), MIN_BLOCK_SIZE))] = on;
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block with at least "size" bytes of payload whose
+ *      address is a multiple of "alignment".  Returns the block, or NULL
+ *      if "alignment" is not a power of two or the allocation failed.
+ */
+void *
+mm_memalign(size_t alignment, size_t size)
+{
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+                return (NULL);
+        /* Every block is already ALIGNMENT-aligned. */
+        if (alignment <= ALIGNMENT)
+                return (mm_malloc(size));
+#ifdef MM_GUARDS
+        void *bp;
+
+        if (size == 0)
+                return (NULL);
+        /*
+         * Room for the front guard word and the tail canary; the guarded
+         * payload sits one word into the block, so align that instead.
+         */
+        if ((bp = memalign_core(alignment, size + 2 * WSIZE, WSIZE)) == NULL)
+                return (NULL);
+        return (guard_arm(bp, size));
+#else
+        return (memalign_core(alignment, size, 0));
+#endif
+}
+
+/*
+ * Compile-time specialized allocation.  mm_malloc_fixed must be called
+ * with a compile-time constant size: it is always inlined, so the size
+ * adjustment, the magazine bin computation, and the bin bounds check all
+ * constant-fold, leaving the hot path as a thread-local list pop with no
+ * size-to-class math at all.  MM_DEFINE_MALLOC_FIXED(name, bytes) stamps
+ * out a named zero-argument entry point for one size; the three below
+ * cover common node sizes, and callers hot on other sizes can add their
+ * own instantiation next to them.  Guarded builds take the ordinary
+ * checked path.
+ */
+static inline __attribute__((always_inline)) void *
+mm_malloc_fixed(size_t size)
+{
+#ifdef MM_GUARDS
+        return (mm_malloc(size));
+#else
+        size_t asize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+        int bin = mag_bin(asize);
+
+        if (bin >= 0 && magazines[bin].count > 0) {
+                COUNT_ADD(mag_alloc_hits, 1);
+                return (magazines[bin].blocks[--magazines[bin].count]);
+        }
+        return (malloc_core(size));
+#endif
+}
+
+#define MM_DEFINE_MALLOC_FIXED(name, bytes)                             \
+void *                                                                  \
+name(void)                                                              \
+{                                                                       \
+        return (mm_malloc_fixed(bytes));                                \
+}
+
+MM_DEFINE_MALLOC_FIXED(mm_malloc_fixed_32, 32)
+MM_DEFINE_MALLOC_FIXED(mm_malloc_fixed_64, 64)
+MM_DEFINE_MALLOC_FIXED(mm_malloc_fixed_128, 128)
+
+/*
+ * Requires:
+ *      "out" has room for "count" pointers.
+ *
+ * Effects:
+ *      Allocates "count" blocks of "size" bytes each.  This is the whole
+ *      batch path; mm_malloc_batch only adds guards in debug builds.
+ *      Tries to carve the run out of one free block; when no arena can
+ *      supply the run, falls back to allocating the blocks one by one,
+ *      undoing any partial progress on failure.  Returns 0 and fills
+ *      out[], or -1 with out[] unspecified.
+ */
+static int
+batch_core(size_t size, size_t count, void **out)
+{
+        size_t asize;
+        struct arena *a;
+
+        if (size == 0 || count == 0)
+                return (-1);
+
+        asize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+
+        /* Reject asize * count overflow; carving needs the product. */
+        if (count <= (size_t)-1 / asize) {
+                a = bind_arena();
+                if (arena_malloc_batch(a, asize, count, out) == 0)
+                        return (0);
+                for (int i = 0; i < NUM_ARENAS; i++) {
+                        if (&arenas[i] == a)
+                                continue;
+                        if (arena_malloc_batch(&arenas[i], asize, count,
+                            out) == 0)
+                                return (0);
+                }
+        }
+
+        /* No single block can hold the run: allocate one by one. */
+        for (size_t i = 0; i < count; i++) {
+                if ((out[i] = malloc_core(size)) == NULL) {
+                        while (i > 0)
+                                free_core(out[--i]);
+                        return (-1);
+                }
+        }
+        return (0);
+}
+
+/*
+ * Requires:
+ *      "out" has room for "count" pointers.
+ *
+ * Effects:
+ *      Allocates "count" blocks with at least "size" bytes of payload
+ *      each, amortizing the fit search, list traffic, and locking across
+ *      the whole batch.  Fills out[] and returns 0, or returns -1 if the
+ *      batch cannot be allocated (out[] is then unspecified).
+ */
+int
+mm_malloc_batch(size_t size, size_t count, void **out)
+{
+#ifdef MM_GUARDS
+        if (size == 0 || count == 0)
+                return (-1);
+        /* Room for the front guard word and the tail canary. */
+        if (batch_core(size + 2 * WSIZE, count, out) != 0)
+                return (-1);
+        for (size_t i = 0; i < count; i++)
+                out[i] = guard_arm(out[i], size);
+        return (0);
+#else
+        return (batch_core(size, count, out));
+#endif
+}
+
+/*
+ * Requires:
+ *      "ptrs" holds "count" entries, each either a block address or NULL.
+ *
+ * Effects:
+ *      Frees all "count" blocks.  The array is sorted by address in
+ *      place, so blocks that are physically adjacent are merged into one
+ *      free region with a single pair of boundary tags before the free
+ *      lists are touched, and each arena's lock is taken once per run of
+ *      same-arena pointers rather than once per block.
+ */
+void
+mm_free_batch(void **ptrs, size_t count)
+{
+#ifdef MM_GUARDS
+        /* Guard checking and poisoning dominate, so batching the list
+         * work buys nothing here; keep every check on the simple path. */
+        for (size_t i = 0; i < count; i++)
+                mm_free(ptrs[i]);
+        return;
+#endif
+        size_t i = 0;
+
+        qsort(ptrs, count, sizeof(void *), addr_cmp);
+
+        while (i < count) {
+                void *bp = ptrs[i];
+                struct arena *a;
+
+                if (bp == NULL) {
+                        i++;
+                        continue;
+                }
+                /* mmapped blocks have no neighbors; unmap them directly. */
+                if (is_mmapped_addr(bp)) {
+                        free_core(bp);
+                        i++;
+                        continue;
+                }
+
+                /* Arenas partition the address space, so the pointers of
+                 * one arena are contiguous in the sorted array. */
+                a = arena_of(bp);
+                pthread_mutex_lock(&a->lock);
+
+                while (i < count && ptrs[i] != NULL &&
+                    !is_mmapped_addr(ptrs[i]) && arena_of(ptrs[i]) == a) {
+                        char *run = ptrs[i];
+                        size_t size = GET_SIZE(HDRP(run));
+                        size_t runsize = size;
+
+                        a->frees++;
+                        a->live_bytes -= size;
+                        a->stats[size2class(size)].frees++;
+                        i++;
+
+                        /* Extend the run over physically adjacent blocks:
+                         * they merge with one header/footer write. */
+                        while (i < count &&
+                            (char *)ptrs[i] == run + runsize &&
+                            !is_mmapped_addr(ptrs[i])) {
+                                size = GET_SIZE(HDRP(ptrs[i]));
+                                a->frees++;
+                                a->live_bytes -= size;
+                                a->stats[size2class(size)].frees++;
+                                runsize += size;
+                                a->coalesces++;
+                                i++;
+                        }
+
+                        PUT(HDRP(run), PACK(runsize, 0) |
+                            GET_PREVALLOC(HDRP(run)));
+                        PUT(FTRP(run), PACK(runsize, 0));
+
+                        if (defer_coalescing) {
+                                insertNode(a, (struct pointers *)run);
+                                CLR_PREVALLOC(HDRP(NEXT_BLKP(run)));
+                                a->deferred++;
+                        } else
+                                coalesce(a, run);
+                }
+
+                pthread_mutex_unlock(&a->lock);
+        }
+}
+
+/*
+ * Requires:
+ *      The caller holds pool's lock.
+ *
+ * Effects:
+ *      Reserves one more slab for the pool and points the bump range at
+ *      it.  Returns 0, or -1 if the slab cannot be allocated.
+ */
+static int
+pool_grow(struct mm_pool *pool)
+{
+        struct pool_slab *slab;
+        /* Slots bigger than a standard slab get a slab sized to hold one
+         * slot, so no carve ever runs past the slab's end. */
+        size_t bytes = MAX(POOL_SLAB_BYTES,
+            ALIGN(sizeof(struct pool_slab)) + pool->slot_size);
+
+        if ((slab = mm_malloc(bytes)) == NULL)
+                return (-1);
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->bump = (char *)slab + ALIGN(sizeof(struct pool_slab));
+        pool->bump_end = (char *)slab + bytes;
+        return (0);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Creates an object pool handing out fixed slots of at least "size"
+ *      bytes.  Slots pay no per-object boundary tags: the pool reserves
+ *      whole slabs from the allocator and carves them with a bump pointer
+ *      and a free-slot freelist, so a 48-byte object costs 48 bytes, not
+ *      64.  Pool slots are not guarded in MM_GUARDS builds; the slabs
+ *      themselves are.  Returns the pool, or NULL on failure.
+ */
+struct mm_pool *
+mm_pool_create(size_t size)
+{
+        struct mm_pool *pool;
+
+        if (size == 0)
+                return (NULL);
+
+        if ((pool = mm_malloc(sizeof(struct mm_pool))) == NULL)
+                return (NULL);
+
+        /* A free slot must hold the freelist link. */
+        pool->slot_size = ALIGN(MAX(size, sizeof(void *)));
+        pool->slabs = NULL;
+        pool->free = NULL;
+        pool->bump = NULL;
+        pool->bump_end = NULL;
+        pthread_mutex_init(&pool->lock, NULL);
+        return (pool);
+}
+
+/*
+ * Requires:
+ *      "pool" was returned by mm_pool_create.
+ *
+ * Effects:
+ *      Returns a slot from the pool: a freelist pop, or a bump-pointer
+ *      carve from the newest slab.  No size adjustment, class mapping, or
+ *      split decision runs.  Returns NULL if a new slab cannot be
+ *      reserved.
+ */
+void *
+mm_pool_alloc(struct mm_pool *pool)
+{
+        void *p;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if ((p = pool->free) != NULL) {
+                pool->free = *(void **)p;
+                pthread_mutex_unlock(&pool->lock);
+                return (p);
+        }
+
+        if (pool->bump + pool->slot_size > pool->bump_end &&
+            pool_grow(pool) != 0) {
+                pthread_mutex_unlock(&pool->lock);
+                return (NULL);
+        }
+
+        p = pool->bump;
+        pool->bump += pool->slot_size;
+        pthread_mutex_unlock(&pool->lock);
+        return (p);
+}
+
+/*
+ * Requires:
+ *      "p" was returned by mm_pool_alloc on the same pool.
+ *
+ * Effects:
+ *      Returns the slot to the pool's free-slot list.
+ */
+void
+mm_pool_free(struct mm_pool *pool, void *p)
+{
+        pthread_mutex_lock(&pool->lock);
+        *(void **)p = pool->free;
+        pool->free = p;
+        pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Requires:
+ *      No slot of "pool" is in use.
+ *
+ * Effects:
+ *      Destroys the pool, returning its slabs wholesale to the segregated
+ *      lists: each slab is one ordinary block, so a pool of a million
+ *      objects frees in a handful of mm_free calls.
+ */
+void
+mm_pool_destroy(struct mm_pool *pool)
+{
+        struct pool_slab *slab, *next;
+
+        for (slab = pool->slabs; slab != NULL; slab = next) {
+                next = slab->next;
+                mm_free(slab);
+        }
+        pthread_mutex_destroy(&pool->lock);
+        mm_free(pool);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Allocates a block of at least nmemb * size zeroed bytes.  Returns
+ *      the block, or NULL on overflow or allocation failure.  Large
+ *      requests go straight to mmap even below the regular mmap threshold,
+ *      because the kernel hands back zero pages and the memset can be
+ *      skipped entirely; heap blocks may contain stale data (old payloads,
+ *      boundary tags, list pointers), so they are zeroed with memset.
+ */
+void *
+mm_calloc(size_t nmemb, size_t size)
+{
+        size_t total;
+        void *ptr;
+
+        /* Reject nmemb * size overflow. */
+        if (nmemb != 0 && size > (size_t)-1 / nmemb)
+                return (NULL);
+        total = nmemb * size;
+
+        /* Ignore spurious requests. */
+        if (total == 0)
+                return (NULL);
+
+#ifndef MM_GUARDS
+        /* Fresh mappings are already zero: no memset needed. */
+        if (total >= CALLOC_MMAP_THRESHOLD) {
+                if ((ptr = mmap_malloc(total)) != NULL)
+                        return (ptr);
+        }
+#endif
+
+        ptr = mm_malloc(total);
+        if (ptr != NULL)
+                memset(ptr, 0, total);
+        return (ptr);
+}
+
+/*
+ * Requires:
+ *      asize is an alinged block size, including the overheads from the explicit, un-NULL list.
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Finds if there is an available block of the correct size in a segragated free list and returns it,
+ *      otherwise returns NULL.
+ *
+*/
+struct pointers*
+find_fit(struct arena *a, size_t asize)
+{
+        struct pointers* block;
+
+        // 1. Find the correct list.
+        int idx = size2class(asize);
+
+        /*
+         * 2. Jump straight to the populated lists.  seg_map has one bit per
+         * class, so masking off the classes below idx and taking the lowest
+         * set bit finds the first nonempty candidate list in O(1) instead of
+         * probing every class.
+         */
+        uint64_t mask = a->seg_map & ~((1ull << idx) - 1);
+        while (mask != 0) {
+                int i = __builtin_ctzll(mask);
+                if (i == NUM_CLASSES - 1) {
+                        /* The catch-all class is a treap: best fit in O(log n). */
+                        a->stats[i].searches++;
+                        block = (struct pointers *)treap_find(a->big_root, asize);
+                        if (block != NULL) {
+                                return block;
+                        }
+                        /* Nothing in the treap fits, so nothing larger exists. */
+                        return (NULL);
+                }
+                block = find_block(a, i, asize);
+                if (block != NULL) {
+                        return block;
+                }
+                mask &= mask - 1;  // Clear the bit we just probed.
+        }
+
+        /* Did not find a proper block. */
+        return (NULL);
+}
+
+/*
+ * Requires:
+ *   "bp" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Free and coalesce the block.  This is the whole free path; mm_free is
+ *   a thin wrapper that only adds guard validation in debug builds.
+ */
+static void
+free_core(void *bp)
+{
+        /* Ignore spurious requests. */
+        if (bp == NULL)
+                return;
+
+#ifdef MM_GUARDS
+        /* Catch a double free before the lists are corrupted. */
+        if (!GET_ALLOC(HDRP(bp))) {
+                fprintf(stderr, "mm: double free of %p\n", bp);
+                abort();
+        }
+#endif
+
+        /* mmapped blocks live outside the arenas; unmap them directly.
+         * Only the freeing thread ever touches their headers. */
+        if (is_mmapped_addr(bp)) {
+                COUNT_ADD(mmap_frees, 1);
+                COUNT_SUB(mmap_bytes, GET_SIZE(HDRP(bp)));
+                munmap(HDRP(bp), GET_SIZE(HDRP(bp)));
+                return;
+        }
+
+        /*
+         * Small blocks go onto this thread's magazine without touching the
+         * header or footer.  If the magazine is full, flush half of it back
+         * to the owning arenas first, so the cache stays bounded.
+         */
+        int bin = mag_bin(GET_SIZE_RELAXED(HDRP(bp)));
+        if (bin >= 0) {
+                struct magazine *mag = &magazines[bin];
+
+                if (!mag_registered) {
+                        pthread_once(&mag_key_once, mag_key_init);
+                        pthread_setspecific(mag_key, magazines);
+                        mag_registered = true;
+                }
+
+                if (mag->count == MAG_CAP) {
+                        /* Evict the oldest, coldest half from the bottom
+                         * of the stack; the most recently freed blocks
+                         * keep their warm cache lines. */
+                        for (int i = 0; i < MAG_CAP / 2; i++)
+                                free_to_arena(mag->blocks[i]);
+                        memmove(mag->blocks, mag->blocks + MAG_CAP / 2,
+                            (MAG_CAP - MAG_CAP / 2) * sizeof(void *));
+                        mag->count = MAG_CAP - MAG_CAP / 2;
+                }
+                mag->blocks[mag->count++] = bp;
+                COUNT_ADD(mag_free_hits, 1);
+                return;
+        }
+
+        free_to_arena(bp);
+}
+
+/*
+ * Requires:
+ *   "bp" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Free the block.
+ */
+void
+mm_free(void *bp)
+{
+#ifdef MM_GUARDS
+        size_t req;
+
+        if (bp == NULL)
+                return;
+        void *inner = guard_check(bp, &req);
+        /* Poison the payload (and the front guard with it) so a second
+         * free or a use-after-free write is caught. */
+        memset(bp, GUARD_POISON, req);
+        PUT(inner, (uintptr_t)GUARD_POISON);
+        free_core(inner);
+#else
+        free_core(bp);
+#endif
+}
+
+/*
+ * Requires:
+ *      "ptr" is an allocated arena block of "oldsize" bytes, "newsize" is
+ *      larger, and the caller holds a's lock.
+ *
+ * Effects:
+ *      Tries to grow the block in place by absorbing its free successor,
+ *      splitting off any remainder.  The payload never moves.  Returns
+ *      true if the block now holds at least "newsize" bytes.
+ */
+static bool
+try_extend_next(struct arena *a, void *ptr, size_t oldsize, size_t newsize)
+{
+        if (GET_ALLOC(HDRP(NEXT_BLKP(ptr))))
+                return (false);
+
+        size_t free_block_old_size = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
+
+        if ((free_block_old_size < newsize - oldsize) || (free_block_old_size <= MIN_BLOCK_SIZE))
+                return (false);
+
+        // The next free block is big enough for the reminder of the newsize.
+        // First remove the free block from it's list.
+        removeNode(a, (struct pointers*)NEXT_BLKP(ptr));
+
+        // Check if after combining we can split the rest.
+        if (free_block_old_size - (newsize - oldsize) >= MIN_BLOCK_SIZE) {
+
+                // Combine the blocks and split; the data is
+                // already in place, so there is nothing to copy.
+                PUT(HDRP(ptr), PACK(newsize, 1) |
+                    GET_PREVALLOC(HDRP(ptr)));
+                a->live_bytes += newsize - oldsize;
+                a->splits++;
+
+                // Get a pointer to the next block, after size was changed.
+                void* next_ptr = NEXT_BLKP(ptr);
+
+                // Change the next block (reminder) size, and mark as free.
+                PUT(HDRP(next_ptr), PACK(free_block_old_size - (newsize - oldsize), 0));
+                SET_PREVALLOC(HDRP(next_ptr));
+                PUT(FTRP(next_ptr), PACK(free_block_old_size - (newsize - oldsize), 0));
+
+                // Initialize pointers.
+                ((struct pointers*)next_ptr)->next = NULL;
+                ((struct pointers*)next_ptr)->prev = NULL;
+
+                // Insert the reminder block to it's proper free list.
+                insertNode(a, (struct pointers*)next_ptr);
+
+        } else { // The free block is big enough to merge, but can't split it.
+
+                // Adjust the size of the new block to contain both blocks.
+                PUT(HDRP(ptr), PACK(oldsize + free_block_old_size, 1) |
+                    GET_PREVALLOC(HDRP(ptr)));
+                a->live_bytes += free_block_old_size;
+
+                // The absorbed block is no longer free.
+                SET_PREVALLOC(HDRP(NEXT_BLKP(ptr)));
+        }
+        return (true);
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Returns the size to request when a realloc has to move: "size"
+ *      scaled by the configured growth factor, so a block that keeps
+ *      growing is moved O(log n) times instead of every call.
+ */
+static size_t
+realloc_want(size_t size)
+{
+        if (realloc_growth_pct == 100 ||
+            size > (size_t)-1 / realloc_growth_pct)
+                return (size);
+        return (size * realloc_growth_pct / 100);
+}
+
+/*
+ * Requires:
+ *   "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *   Reallocates the block "ptr" to a block with at least "size" bytes of
+ *   payload, unless "size" is zero.  If "size" is zero, frees the block
+ *   "ptr" and returns NULL.  If the block "ptr" is already a block with at
+ *   least "size" bytes of payload, then "ptr" may optionally be returned.
+ *   Otherwise, a new block is allocated and the contents of the old block
+ *   "ptr" are copied to that new block.  Returns the address of this new
+ *   block if the allocation was successful and NULL otherwise.
+ */
+void *
+mm_realloc(void *ptr, size_t size)
+{
+        COUNT_ADD(realloc_calls, 1);
+#ifdef MM_GUARDS
+        /*
+         * In guarded builds every block is re-armed through mm_malloc, so
+         * grow/shrink always goes through allocate-copy-free.
+         */
+        if (ptr == NULL)
+                return (mm_malloc(size));
+        if (size == 0) {
+                mm_free(ptr);
+                return (NULL);
+        }
+        size_t req;
+        guard_check(ptr, &req);
+        void *newp = mm_malloc(realloc_want(size));
+        if (newp == NULL)
+                return (NULL);
+        memcpy(newp, ptr, MIN(req, size));
+        mm_free(ptr);
+        return (newp);
+#endif
+        size_t oldsize;
         size_t newsize;
         void *newptr;
-        size_t min_block_size =  (2 * DSIZE) + sizeof(struct pointers);
+        struct arena *a;
+
+        /* If oldptr is NULL, then this is just a malloc call. */
+        if (ptr == NULL) {
+                newptr = mm_malloc(size);
+                return (newptr);
+        }
 
         /* If size is 0, just free the pointer. */
         if (size == 0) {
@@ -314,279 +2775,761 @@ mm_realloc(void *ptr, size_t size)
                 return (NULL);
         }
 
-        /* If size is smaller than minimum size, align to minimum size. */
-        if (size <= DSIZE) {
-                newsize = 2 * WSIZE + sizeof(struct pointers); 
-        }
+        oldsize = GET_SIZE(HDRP(ptr));
 
-        /* Else, align the size and add the extra payload for pointers. */
-        else {
-                newsize = ALIGN((size));
-                newsize = newsize + DSIZE;
-        }
+        /* Adjust the size the same way mm_malloc does: header word plus
+         * alignment, never below the minimum block size. */
+        newsize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
 
-        /* If oldptr is NULL, then this is just a malloc call. */
-        if (ptr == NULL) {
-                newptr = mm_malloc(size);
-                return (newptr);
-        }
-        
         /* If newsize smaller or equal to oldsize, return it. */
         if (newsize <= oldsize) {
                 return (ptr);
         }
-        
+
+        /*
+         * mmapped blocks have no heap neighbors to merge with; grow by
+         * allocating a new block and copying the old payload.
+         */
+        if (GET_MMAPPED(HDRP(ptr))) {
+                newptr = mm_malloc(realloc_want(size));
+                if (newptr == NULL)
+                        return (NULL);
+                memcpy(newptr, ptr, oldsize - WSIZE);
+                mm_free(ptr);
+                return (newptr);
+        }
+
         /* We know newsize bigger than oldsize, must obtain more space for the pointer. */
-        
+
+        a = arena_of(ptr);
+        pthread_mutex_lock(&a->lock);
+
         // Case 1: either the previous or next block are free & has enough space to merge the blocks.
-        if (!GET_ALLOC(HDRP(PREV_BLKP(ptr)))) { // Previous block is free. 
+        if (!GET_PREVALLOC(HDRP(ptr))) { // Previous block is free.
 
                 size_t free_block_old_size = GET_SIZE(HDRP(PREV_BLKP(ptr)));
                 if (free_block_old_size >= newsize - oldsize) { // Previous block is big enough to merge.
-                        
-                        removeNode((struct pointers*) PREV_BLKP(ptr)); // Remover the prev free block from it's list.
+
+                        removeNode(a, (struct pointers*) PREV_BLKP(ptr)); // Remover the prev free block from it's list.
                         newptr = PREV_BLKP(ptr);
 
-                        /* Allocate the new block and adjust the size of the new block. */                         
-                        PUT(HDRP(newptr), PACK(free_block_old_size + oldsize, 1)); 
-                        PUT(FTRP(newptr), PACK(free_block_old_size + oldsize, 1));
+                        /* Allocate the new block and adjust the size of the new block. */
+                        PUT(HDRP(newptr), PACK(free_block_old_size + oldsize, 1) |
+                            GET_PREVALLOC(HDRP(newptr)));
+                        a->live_bytes += free_block_old_size;
 
-                        /* Copy the data */
-                        memcpy(newptr, ptr, oldsize - DSIZE);
+                        /* Copy the data; source and destination overlap. */
+                        memmove(newptr, ptr, oldsize - WSIZE);
+                        pthread_mutex_unlock(&a->lock);
                         return (newptr);
                 }
         }
-        
-        if (!GET_ALLOC(HDRP(NEXT_BLKP(ptr)))) { // Next block is free.
-
-                size_t free_block_old_size = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-
-                if ((free_block_old_size >= newsize - oldsize) && (free_block_old_size > min_block_size)) {
-                        
-                        // The next free block is big enough for the reminder of the newsize.
-                        // First remove the free block from it's list. 
-                        removeNode((struct pointers*)NEXT_BLKP(ptr));
-                        newptr = ptr;
-                        
-                        // Check if after combining we can split the rest.
-                        if (free_block_old_size - (newsize - oldsize) >= min_block_size) {
-                                
-                                // Combine the blocks and split.
-                                // Adjust the size of the new block.                         
-                                PUT(HDRP(newptr), PACK(newsize, 1)); 
-                                PUT(FTRP(newptr), PACK(newsize, 1)); 
-
-                                memcpy(newptr, ptr, newsize - DSIZE);
-                                
-                                // Get a pointer to the next block, after size was changed.
-                                void* next_ptr = NEXT_BLKP(newptr);                                
-
-                                // Change the next block (reminder) size, and mark as free.
-                                PUT(HDRP(next_ptr), PACK(free_block_old_size - (newsize - oldsize), 0));
-                                PUT(FTRP(next_ptr), PACK(free_block_old_size - (newsize - oldsize), 0));
-                                
-                                // Initialize pointers.
-                                ((struct pointers*)next_ptr)->next = NULL;
-                                ((struct pointers*)next_ptr)->prev = NULL;
-
-                                // Insert the reminder block to it's proper free list.
-                                insertNode((struct pointers*)next_ptr);
-
-                                return (newptr);
-
-                        } else { // The free block is big enough to merge, but can't split it.                                  
-                                
-                                // Adjust the size of the new block to contain both blocks.                        
-                                PUT(HDRP(newptr), PACK(oldsize + free_block_old_size, 1)); 
-                                PUT(FTRP(newptr), PACK(oldsize + free_block_old_size, 1)); 
-                                
-                                // Copy the data.
-                                memcpy(newptr, ptr, free_block_old_size + oldsize - DSIZE);
-                                return (newptr);
-                        }
-                }
+
+        if (try_extend_next(a, ptr, oldsize, newsize)) { // Next block is free and big enough.
+                pthread_mutex_unlock(&a->lock);
+                return (ptr);
         }
-        
+
+        pthread_mutex_unlock(&a->lock);
+
         // Case 2: the prev/next block are not free or dont have enough space: find new space.
-        newptr = mm_malloc((int)(2 * size));
-        
-         /* Copy */
-        newsize = ALIGN((int)(2 * size));
-        newsize = newsize + DSIZE;
-        memcpy(newptr, ptr, newsize - DSIZE);
-        
-        /* Free the old block. */    
+        newptr = mm_malloc(realloc_want(size));
+        if (newptr == NULL)
+                return (NULL);
+
+         /* Copy exactly the old payload; the new block is at least as big. */
+        memcpy(newptr, ptr, oldsize - WSIZE);
+
+        /* Free the old block. */
         mm_free(ptr);
-        return (newptr);   
+        return (newptr);
+}
+
+/*
+ * Requires:
+ *      "ptr" is either the address of an allocated block or NULL.
+ *
+ * Effects:
+ *      Resizes the block to at least "size" bytes without ever moving the
+ *      payload: shrinks in place, or grows by absorbing a free successor.
+ *      Returns "ptr" on success and NULL if the block cannot be resized
+ *      where it is; the block is then left untouched, so callers holding
+ *      interior pointers into the payload can fall back on their own
+ *      terms.
+ */
+void *
+mm_realloc_in_place(void *ptr, size_t size)
+{
+        if (ptr == NULL || size == 0)
+                return (NULL);
+#ifdef MM_GUARDS
+        /*
+         * Guarded blocks carry a tail canary right after the requested
+         * size, so only requests the current arming already covers can
+         * succeed without re-arming, which would move the payload.
+         */
+        size_t req;
+
+        guard_check(ptr, &req);
+        return (size <= req ? ptr : NULL);
+#else
+        size_t oldsize = GET_SIZE(HDRP(ptr));
+        size_t newsize = MAX(ALIGN(size + WSIZE), MIN_BLOCK_SIZE);
+        struct arena *a;
+        bool grown;
+
+        if (newsize <= oldsize)
+                return (ptr);
+
+        /* mmapped blocks have no free neighbors to absorb. */
+        if (GET_MMAPPED(HDRP(ptr)))
+                return (NULL);
+
+        a = arena_of(ptr);
+        pthread_mutex_lock(&a->lock);
+        grown = try_extend_next(a, ptr, oldsize, newsize);
+        pthread_mutex_unlock(&a->lock);
+        return (grown ? ptr : NULL);
+#endif
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Sets the over-allocation factor mm_realloc applies when it has to
+ *      move a block, in percent of the requested size: 150 makes a moved
+ *      block half again as large as the request, so a steadily growing
+ *      buffer moves geometrically rarely.  Values up to 100 restore the
+ *      default exact-size copies.
+ */
+void
+mm_set_realloc_growth(unsigned percent)
+{
+        realloc_growth_pct = MAX(percent, 100);
 }
 
 
 /*
  * Requires:
- *      "bp" is the address of a newly freed block and has not been placed in free list yet. 
+ *      "bp" is a free block of at least MADVISE_THRESHOLD bytes, and the
+ *      caller holds a's lock.
+ *
+ * Effects:
+ *      Hands the page-aligned interior of "bp" back to the kernel with
+ *      madvise(MADV_DONTNEED), keeping the header, footer, and free list
+ *      fields intact.  The returned bit on the header provides hysteresis:
+ *      a block is only madvised once until its header is rewritten by a
+ *      later allocation or merge, so churny workloads don't thrash.
+ */
+static void
+return_pages(struct arena *a, void *bp)
+{
+        size_t pagesize = mem_pagesize();
+        size_t size = GET_SIZE(HDRP(bp));
+        char *start, *end;
+
+        if (GET_RETURNED(HDRP(bp)))
+                return;
+
+        /* Keep the first words (list or treap fields) and the footer. */
+        start = (char *)(((uintptr_t)bp + 4 * WSIZE + pagesize - 1) &
+            ~(pagesize - 1));
+        end = (char *)(((uintptr_t)bp + size - DSIZE) & ~(pagesize - 1));
+        if (end <= start)
+                return;
+
+        if (madvise(start, (size_t)(end - start), MADV_DONTNEED) == 0) {
+                SET_RETURNED(HDRP(bp));
+                a->madvises++;
+                a->returned_bytes += (size_t)(end - start);
+        }
+}
+
+/*
+ * Requires:
+ *      "bp" is the address of a newly freed block and has not been placed in free list yet.
+ *      The caller holds a's lock, and "bp" belongs to arena a.
  *
  * Effects:
- *      Perform boundary tag coalescing. 
+ *      Perform boundary tag coalescing.
  *      Returns the address of the coalesced block.
  */
 static void *
-coalesce(void *bp) 
+coalesce(struct arena *a, void *bp)
 {
-        /* get the size of the block we are pointing at. */ 
+        /* get the size of the block we are pointing at. */
         size_t size = GET_SIZE(HDRP(bp));
-        
-        /* Check if neighbors blocks are allocated. */
-        bool prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
-        bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));             
+
+        /*
+         * Check if neighbors blocks are allocated.  The previous block's
+         * state comes from our own header's prev-allocated bit, since an
+         * allocated previous block has no footer to read.
+         */
+        bool prev_alloc = GET_PREVALLOC(HDRP(bp)) != 0;
+        bool next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
 
         if (prev_alloc && next_alloc) {                 /* Case 1: prev and next physical blocks are allocated. */
-                insertNode((struct pointers*)bp);  
+                insertNode(a, (struct pointers*)bp);
 
         } else if (prev_alloc && !next_alloc) {         /* Case 2: only next physical block is allocated: merge with next block. */
 
-                removeNode((struct pointers*)(NEXT_BLKP(bp)));
-                size += GET_SIZE(HDRP(NEXT_BLKP(bp))); 
-                PUT(HDRP(bp), PACK(size, 0));          
-                PUT(FTRP(bp), PACK(size, 0));    
-                insertNode((struct pointers*)bp); 
+                removeNode(a, (struct pointers*)(NEXT_BLKP(bp)));
+                size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+                PUT(HDRP(bp), PACK(size, 0) | GET_PREVALLOC(HDRP(bp)));
+                PUT(FTRP(bp), PACK(size, 0));
+                insertNode(a, (struct pointers*)bp);
+                a->coalesces++;
 
         } else if (!prev_alloc && next_alloc) {         /* Case 3: only prev physical block is allocated: merge with prev block. */
 
-                removeNode((struct pointers*)(PREV_BLKP(bp)));
+                removeNode(a, (struct pointers*)(PREV_BLKP(bp)));
                 size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-                PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-                PUT(FTRP(bp), PACK(size, 0)); 
+                PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) |
+                    GET_PREVALLOC(HDRP(PREV_BLKP(bp))));
+                PUT(FTRP(bp), PACK(size, 0));
                 bp = PREV_BLKP(bp);
-                insertNode((struct pointers*)bp); 
-        
+                insertNode(a, (struct pointers*)bp);
+                a->coalesces++;
+
         } else {                                        /* Case 4: both prev and next physical blocks are free: merge with both. */
 
-                removeNode((struct pointers*)(NEXT_BLKP(bp)));
-                removeNode((struct pointers*)(PREV_BLKP(bp)));
-                size += (GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+                removeNode(a, (struct pointers*)(NEXT_BLKP(bp)));
+                removeNode(a, (struct pointers*)(PREV_BLKP(bp)));
+                size += (GET_SIZE(HDRP(PREV_BLKP(bp))) +
                         GET_SIZE(FTRP(NEXT_BLKP(bp))));
-                PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
                 PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+                PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0) |
+                    GET_PREVALLOC(HDRP(PREV_BLKP(bp))));
                 bp = PREV_BLKP(bp);
-                insertNode((struct pointers*)bp); 
+                insertNode(a, (struct pointers*)bp);
+                a->coalesces++;
         }
-        
+
+        /* The block after a free block must not claim its neighbor is allocated. */
+        CLR_PREVALLOC(HDRP(NEXT_BLKP(bp)));
+
+        /* Large free blocks hand their interior pages back to the kernel. */
+        if (GET_SIZE(HDRP(bp)) >= MADVISE_THRESHOLD)
+                return_pages(a, bp);
+
+        mark_dirty(a, bp);
+
     return (bp);
 }
 
-/* 
+/*
  * Requires:
- *   None.
+ *   The caller holds a's lock.
  *
  * Effects:
- *   Extend the heap with a free block and return that block's address.
+ *   Extend arena a's heap with a free block and return that block's address.
  */
 static void *
-extend_heap(size_t words) 
+extend_heap(struct arena *a, size_t words)
 {
         size_t size;
         void *bp;
 
+        a->extends++;
+
         /* Allocate an even number of words to maintain alignment. */
         size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE;
-        
+
+        /*
+         * Round large extensions up to whole huge pages, so the brk keeps
+         * pace with 2 MB boundaries and the kernel can actually promote
+         * the pages it was advised about.  Never let the rounding push a
+         * request that would have fit past the region limit.
+         */
+        if (use_hugepages && size >= HUGEPAGE_SIZE) {
+                size_t rounded = (size + HUGEPAGE_SIZE - 1) &
+                    ~(size_t)(HUGEPAGE_SIZE - 1);
+
+                if (a->brk + rounded <= a->limit)
+                        size = rounded;
+        }
+
         /* Allocate space of size */
-        if ((bp = mem_sbrk(size)) == (void *)-1)  // bp is the the first byte in the newly allocated heap area
+        if ((bp = arena_sbrk(a, size)) == (void *)-1)  // bp is the the first byte in the newly allocated heap area
                 return (NULL);
 
-        
-        /* Initialize free block header/footer and the epilogue header in the new heap area. */
-        PUT(HDRP(bp), PACK(size, 0));         /* Free block header */
-        PUT(FTRP(bp), PACK(size, 0));         /* Free block footer */
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* New epilogue header */
 
-        bp = coalesce(bp);
+        /*
+         * Initialize free block header/footer and the epilogue header in the
+         * new heap area.  The old epilogue header becomes the new block's
+         * header, so carry its prev-allocated bit over.
+         */
+        uintptr_t prev_bit = GET_PREVALLOC(HDRP(bp));
+        PUT(HDRP(bp), PACK(size, 0) | prev_bit); /* Free block header */
+        PUT(FTRP(bp), PACK(size, 0));            /* Free block footer */
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));    /* New epilogue header */
+
+        bp = coalesce(a, bp);
         return (bp);
 }
 
 
 /*
  * Requires:
- *      "bp" is a pointer to the block that needs to be removed from the free list. 
+ *      "bp" is a pointer to the block that needs to be removed from the free list.
  *
  * Effects:
- *      Removes "bp" from it's segragated free list.    
+ *      Removes "bp" from it's segragated free list.
  */
 static void
-removeNode(struct pointers *bp)
-{ 
+removeNode(struct arena *a, struct pointers *bp)
+{
+        scrub_dirty(a, bp);
+
+        /* Blocks in the catch-all class live in the treap, not a list. */
+        if (size2class(GET_SIZE(HDRP(bp))) == NUM_CLASSES - 1) {
+                a->big_root = treap_remove(a->big_root, (struct treap_node *)bp);
+                if (a->big_root == NULL)
+                        a->seg_map &= ~(1ull << (NUM_CLASSES - 1));
+                return;
+        }
+
         bp->prev->next = bp->next;
         bp->next->prev = bp->prev;
+
+        /*
+         * If bp was the only block in its list, next and prev both point at
+         * the list head; clear that class's bit in the nonempty mask.
+         */
+        if (bp->next == bp->prev)
+                a->seg_map &= ~(1ull << (bp->next - &a->free_lists[0]));
 }
 
 /*
  * Requires:
- *      "bp" is a pointer to the block that needs to be inserted to a free list. 
+ *      "bp" is a pointer to the block that needs to be inserted to a free list.
+ *      The caller holds a's lock, and "bp" belongs to arena a.
  *
  * Effects:
- *      Finds the appropriate free list and inserts bp.    
+ *      Finds the appropriate free list in arena a and inserts bp.
  */
 static void
-insertNode(struct pointers *bp)
-{ 
-        // Find the appropriate free list to insert the free block.
-        struct pointers *list_head = get_free_list_head(GET_SIZE(HDRP(bp))); 
+insertNode(struct arena *a, struct pointers *bp)
+{
+        /* Blocks in the catch-all class go into the treap. */
+        if (size2class(GET_SIZE(HDRP(bp))) == NUM_CLASSES - 1) {
+                struct treap_node *node = (struct treap_node *)bp;
+
+                node->priority = treap_priority(node);
+                a->big_root = treap_insert(a->big_root, node);
+                a->seg_map |= 1ull << (NUM_CLASSES - 1);
+                return;
+        }
 
-        // Insert.
-        list_head->prev->next = bp;
-        bp->prev = list_head->prev;
-        list_head->prev = bp;
-        bp->next = list_head;
+        // Find the appropriate free list to insert the free block.
+        struct pointers *list_head = get_free_list_head(a, GET_SIZE(HDRP(bp)));
+
+        // Mark the class nonempty.
+        a->seg_map |= 1ull << (list_head - &a->free_lists[0]);
+
+        if (class_policy[list_head - &a->free_lists[0]] == INSERT_LIFO) {
+                /* Head insert: the freed block is reused first while it is
+                 * still warm in this core's cache. */
+                bp->next = list_head->next;
+                bp->prev = list_head;
+                list_head->next->prev = bp;
+                list_head->next = bp;
+        } else {
+                /* Address-ordered insert: walk to the first block with a
+                 * higher address and link in front of it.  Same dependent
+                 * pointer chase as find_block, same prefetch. */
+                struct pointers *cur = list_head->next;
+
+                while (cur != list_head && cur < bp) {
+                        __builtin_prefetch(cur->next);
+                        cur = cur->next;
+                }
+                bp->next = cur;
+                bp->prev = cur->prev;
+                cur->prev->next = bp;
+                cur->prev = bp;
+        }
 }
-        
 
-/* 
+
+/*
  * Requires:
  *      "bp" is the address of a free block that is at least "asize" bytes.
+ *      The caller holds a's lock, and "bp" belongs to arena a.
  *
  * Effects:
  *      Place a block of "asize" bytes at the start of the free block "bp" and
- *      split that block if the remainder would be at least the minimum block size. 
+ *      split that block if the remainder would be at least the minimum block size.
  */
 static void
-place(void *bp, size_t asize)
+place(struct arena *a, void *bp, size_t asize)
 {
         size_t csize = GET_SIZE(HDRP(bp));  // Get the size of the free block.
-        size_t min_block_size =  (2 * WSIZE) + sizeof(struct pointers); // Minimum size of a block.
-        
+
         /* Always need to remove the node. */
-        removeNode(bp);
-        
-        /* 
-         * Check if the block we are going to place is smaller than the free block 
+        removeNode(a, bp);
+
+        /*
+         * Cache-line coloring for classes that opted in: grow the block
+         * into the slack the split would return so that (a) the block ends
+         * one word before a line boundary, putting the next block's header
+         * -- which mm_free and coalesce write -- on its own line instead
+         * of sharing one with this payload's tail, and (b) successive
+         * allocations shift by a rotating number of whole lines, spreading
+         * same-class objects over different L1 sets.  Purely a size
+         * adjustment, so the block format and every later path are
+         * untouched; the pad is simply internal to the block.
+         */
+        if (csize > asize && class_colored[size2class(asize)]) {
+                int idx = size2class(asize);
+                size_t slack = csize - asize;
+                size_t pad = (WSIZE - ((uintptr_t)bp + asize)) &
+                    (CACHE_LINE - 1);
+                size_t rot = pad + (size_t)(a->color_rr[idx] &
+                    (COLOR_LINES - 1)) * CACHE_LINE;
+
+                if (rot <= slack) {
+                        asize += rot;
+                        a->color_rr[idx]++;
+                } else if (pad <= slack)
+                        asize += pad;
+        }
+
+        /*
+         * Check if the block we are going to place is smaller than the free block
          * and if the remainder of the space is enough to be an independent block.
          */
 
-        if ((csize - asize) >= min_block_size) {   /* The case we have enough space to split. */
+        if ((csize - asize) >= MIN_BLOCK_SIZE) {   /* The case we have enough space to split. */
+
+                /* Allocate asize; allocated blocks carry no footer. */
+                PUT(HDRP(bp), PACK(asize, 1) | GET_PREVALLOC(HDRP(bp)));
+                a->live_bytes += asize;
+                a->splits++;
 
-                /* Allocate asize. */
-                PUT(HDRP(bp), PACK(asize, 1)); 
-                PUT(FTRP(bp), PACK(asize, 1)); 
-                
                 /* Get the location of next block. */
-                bp = NEXT_BLKP(bp); 
-                
+                bp = NEXT_BLKP(bp);
+
                 /* Allocated the remainder of the block and mark as free. */
-                PUT(HDRP(bp), PACK(csize - asize, 0)); 
-                PUT(FTRP(bp), PACK(csize - asize, 0)); 
+                PUT(HDRP(bp), PACK(csize - asize, 0));
+                SET_PREVALLOC(HDRP(bp));
+                PUT(FTRP(bp), PACK(csize - asize, 0));
 
                 /* Insert the reminder of the block into a free list. */
-                insertNode((struct pointers*)bp);  
-                        
-        } else {        /* The case we don't have enough space for another block, allocate whole thing. */ 
-                PUT(HDRP(bp), PACK(csize, 1)); 
-                PUT(FTRP(bp), PACK(csize, 1));
+                insertNode(a, (struct pointers*)bp);
+
+        } else {        /* The case we don't have enough space for another block, allocate whole thing. */
+                PUT(HDRP(bp), PACK(csize, 1) | GET_PREVALLOC(HDRP(bp)));
+                SET_PREVALLOC(HDRP(NEXT_BLKP(bp)));
+                a->live_bytes += csize;
+        }
+
+        mark_dirty(a, bp);
+}
+
+/*
+ * Requires:
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Merge every run of adjacent free blocks in arena a.  Used to batch
+ *      up the coalescing that deferred frees skipped.
+ */
+static void
+coalesce_arena(struct arena *a)
+{
+        char *bp;
+
+        for (bp = (char *)NEXT_BLKP(a->heap_listp); GET_SIZE(HDRP(bp)) > 0;
+            bp = (char *)NEXT_BLKP(bp)) {
+                if (GET_ALLOC(HDRP(bp)))
+                        continue;
+
+                /* Merge the whole run of free blocks starting at bp. */
+                char *nb = (char *)NEXT_BLKP(bp);
+                if (GET_ALLOC(HDRP(nb)))
+                        continue;
+
+                size_t size = GET_SIZE(HDRP(bp));
+                removeNode(a, (struct pointers *)bp);
+                do {
+                        removeNode(a, (struct pointers *)nb);
+                        size += GET_SIZE(HDRP(nb));
+                        nb = (char *)NEXT_BLKP(nb);
+                } while (!GET_ALLOC(HDRP(nb)));
+
+                PUT(HDRP(bp), PACK(size, 0) | GET_PREVALLOC(HDRP(bp)));
+                PUT(FTRP(bp), PACK(size, 0));
+                insertNode(a, (struct pointers *)bp);
+                a->coalesces++;
+                if (size >= MADVISE_THRESHOLD)
+                        return_pages(a, bp);
+        }
+        a->deferred = 0;
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Returns the number of heap bytes the arenas have actually carved
+ *      out of their regions.  mem_heapsize() reports the whole up-front
+ *      reservation, so benchmarks should measure utilization against this.
+ */
+size_t
+mm_heap_used(void)
+{
+        size_t used = 0;
+
+        for (int i = 0; i < NUM_ARENAS; i++)
+                used += (size_t)(arenas[i].brk -
+                    (arena_base + i * arena_region));
+        return (used);
+}
+
+/*
+ * Requires:
+ *      "st" points to a caller-owned struct mm_stats.
+ *
+ * Effects:
+ *      Fills "st" with a snapshot of the allocator counters, summing the
+ *      per-arena counters and reading the unlocked ones with relaxed
+ *      atomics.  No locks are taken, so the snapshot is approximate while
+ *      other threads are allocating.
+ */
+void
+mm_stats(struct mm_stats *st)
+{
+        memset(st, 0, sizeof(*st));
+
+        st->mag_alloc_hits = __atomic_load_n(&mag_alloc_hits, __ATOMIC_RELAXED);
+        st->mag_free_hits = __atomic_load_n(&mag_free_hits, __ATOMIC_RELAXED);
+        st->mmap_allocs = __atomic_load_n(&mmap_allocs, __ATOMIC_RELAXED);
+        st->mmap_frees = __atomic_load_n(&mmap_frees, __ATOMIC_RELAXED);
+        st->mmap_bytes = __atomic_load_n(&mmap_bytes, __ATOMIC_RELAXED);
+        st->realloc_calls = __atomic_load_n(&realloc_calls, __ATOMIC_RELAXED);
+        st->remote_frees = __atomic_load_n(&remote_free_pushes,
+            __ATOMIC_RELAXED);
+        st->heap_used = mm_heap_used();
+
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
+
+                st->arena_mallocs += a->mallocs;
+                st->arena_frees += a->frees;
+                st->live_bytes += a->live_bytes;
+                st->extend_calls += a->extends;
+                st->splits += a->splits;
+                st->coalesces += a->coalesces;
+                st->madvise_calls += a->madvises;
+                st->returned_bytes += a->returned_bytes;
+                for (int j = 0; j < NUM_CLASSES; j++) {
+                        st->class_allocs[j] += a->stats[j].allocs;
+                        st->class_frees[j] += a->stats[j].frees;
+                }
+                for (int j = 0; j < SEARCH_HIST_BUCKETS; j++)
+                        st->search_hist[j] += a->search_hist[j];
+        }
+}
+
+/*
+ * Requires:
+ *      None.
+ *
+ * Effects:
+ *      Turn deferred coalescing on or off.  Turning it off flushes every
+ *      arena, so the heap is fully coalesced when the call returns.
+ */
+void
+mm_set_deferred_coalescing(bool on)
+{
+        if (!on && defer_coalescing) {
+                for (int i = 0; i < NUM_ARENAS; i++) {
+                        struct arena *a = &arenas[i];
+
+                        pthread_mutex_lock(&a->lock);
+                        if (a->deferred > 0)
+                                coalesce_arena(a);
+                        pthread_mutex_unlock(&a->lock);
+                }
+        }
+        defer_coalescing = on;
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Print per-class search statistics, summed across arenas: how many
+ *   find_block searches each class saw, the mean search length, and how
+ *   often the SEARCH_BOUND bail-out fired.  Used to tune SEARCH_BOUND.
+ */
+void
+print_search_stats(void)
+{
+        printf("class   searches    scanned   bailouts  avg-scan\n");
+        for (int j = 0; j < NUM_CLASSES; j++) {
+                uint64_t searches = 0, scanned = 0, bailouts = 0;
+
+                for (int i = 0; i < NUM_ARENAS; i++) {
+                        searches += arenas[i].stats[j].searches;
+                        scanned += arenas[i].stats[j].scanned;
+                        bailouts += arenas[i].stats[j].bailouts;
+                }
+                if (searches == 0)
+                        continue;
+                printf("%5d %10lu %10lu %10lu %9.2f\n", j,
+                    (unsigned long)searches, (unsigned long)scanned,
+                    (unsigned long)bailouts, (double)scanned / searches);
         }
 }
 
-/* 
- * The remaining routines are heap consistency checker routines. 
+/*
+ * The remaining routines are heap consistency checker routines.
+ */
+
+/*
+ * Requires:
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Records "bp" as recently touched so the sampled checker revisits it.
+ */
+static void
+mark_dirty(struct arena *a, void *bp)
+{
+        struct dirty_ent *e;
+
+        if (!sampled_checking)
+                return;
+        e = &a->dirty_ring[a->dirty_head++ % DIRTY_RING];
+        e->bp = bp;
+        e->hdr = GET(HDRP(bp));
+}
+
+/*
+ * Requires:
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Forgets any checker hints for "bp".  Called when a free block is
+ *      absorbed by a merge: its header word survives the merge, so the
+ *      header comparison alone would not notice the hint went stale.
+ */
+static void
+scrub_dirty(struct arena *a, void *bp)
+{
+        if (!sampled_checking)
+                return;
+        for (int j = 0; j < DIRTY_RING; j++)
+                if (a->dirty_ring[j].bp == bp)
+                        a->dirty_ring[j].bp = NULL;
+        if (a->check_cursor.bp == bp)
+                a->check_cursor.bp = NULL;
+}
+
+/*
+ * Requires:
+ *      The caller holds a's lock.
+ *
+ * Effects:
+ *      Conservatively decides whether "bp" still looks like a block in
+ *      arena a.  Dirty ring entries and the walk cursor are hints that can
+ *      go stale when a block is merged away, so anything failing these
+ *      checks is silently skipped rather than reported.
+ */
+static bool
+block_sane(struct arena *a, void *bp)
+{
+        char *base = arena_base + (a - arenas) * arena_region;
+        size_t size;
+
+        if (bp == NULL || ((uintptr_t)bp % WSIZE) != 0)
+                return (false);
+        if ((char *)bp < base + 3 * WSIZE || (char *)bp >= a->brk)
+                return (false);
+        size = GET_SIZE(HDRP(bp));
+        if (size < MIN_BLOCK_SIZE || (size % ALIGNMENT) != 0)
+                return (false);
+        if ((char *)bp - WSIZE + size > a->brk)
+                return (false);
+        return (true);
+}
+
+/*
+ * Requires:
+ *   None.
+ *
+ * Effects:
+ *   Incremental, time-budgeted heap verification that is cheap enough to
+ *   run in production.  Each call drains the per-arena dirty rings (blocks
+ *   touched by place/coalesce since the last call) and then resumes a
+ *   cursor walk over each arena's blocks, checking as many as fit in
+ *   "budget_us" microseconds before returning.  Arenas are locked one at a
+ *   time, so allocation in other arenas keeps running.
  */
+void
+checkheap_sampled(long budget_us)
+{
+        struct timespec t0, t1;
+        long elapsed_us = 0;
+
+        sampled_checking = true;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+
+        for (int i = 0; i < NUM_ARENAS && elapsed_us < budget_us; i++) {
+                struct arena *a = &arenas[i];
+                char *base = arena_base + i * arena_region;
+
+                pthread_mutex_lock(&a->lock);
+
+                /* 1. Recheck the blocks touched since the last call. */
+                for (int j = 0; j < DIRTY_RING; j++) {
+                        struct dirty_ent *e = &a->dirty_ring[j];
+
+                        if (e->bp == NULL)
+                                continue;
+                        if (block_sane(a, e->bp) && GET(HDRP(e->bp)) == e->hdr)
+                                checkblock(e->bp);
+                        e->bp = NULL;
+                }
+
+                /* 2. Resume the cursor walk over this arena's blocks. */
+                if (!block_sane(a, a->check_cursor.bp) ||
+                    GET(HDRP(a->check_cursor.bp)) != a->check_cursor.hdr)
+                        a->check_cursor.bp = base + DSIZE + WSIZE;
+                for (int checked = 0;; checked++) {
+                        if (GET_SIZE(HDRP(a->check_cursor.bp)) == 0) {
+                                /* Epilogue: wrap to the first block. */
+                                a->check_cursor.bp = base + DSIZE + WSIZE;
+                                break;
+                        }
+                        checkblock(a->check_cursor.bp);
+                        a->check_cursor.bp = NEXT_BLKP(a->check_cursor.bp);
+
+                        if ((checked & 63) == 63) {
+                                clock_gettime(CLOCK_MONOTONIC, &t1);
+                                elapsed_us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+                                    (t1.tv_nsec - t0.tv_nsec) / 1000;
+                                if (elapsed_us >= budget_us)
+                                        break;
+                        }
+                }
+
+                /* Remember the cursor's header so a merge is noticed. */
+                a->check_cursor.hdr = GET(HDRP(a->check_cursor.bp));
+
+                pthread_mutex_unlock(&a->lock);
+
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                elapsed_us = (t1.tv_sec - t0.tv_sec) * 1000000 +
+                    (t1.tv_nsec - t0.tv_nsec) / 1000;
+        }
+}
 
 /*
  * Requires:
@@ -596,70 +3539,83 @@ place(void *bp, size_t asize)
  *   Perform a check on the block "bp".
  */
 static void
-checkblock(void *bp) 
+checkblock(void *bp)
 {
         if ((uintptr_t)bp % WSIZE)
                 printf("Error: %p is not singleword aligned\n", bp);
-        if (GET(HDRP(bp)) != GET(FTRP(bp)))
-                printf("Error: header does not match footer\n");
-        if (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
-                printf("Error: size at header does not match size at footer\n");  
-        if (GET_ALLOC(HDRP(bp)) != GET_ALLOC(FTRP(bp)))
-                printf("Error: allocation at header does not match allocation at footer\n");                  
+        /* Only free blocks carry a footer. */
+        if (!GET_ALLOC(HDRP(bp))) {
+                if (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp)))
+                        printf("Error: size at header does not match size at footer\n");
+                if (GET_ALLOC(HDRP(bp)) != GET_ALLOC(FTRP(bp)))
+                        printf("Error: allocation at header does not match allocation at footer\n");
+        }
 }
 
-/* 
+/*
  * Requires:
- *   None.
+ *   No other thread is mutating the heap.
  *
  * Effects:
- *   Perform a check of the heap for consistency. 
+ *   Perform a check of every arena's heap for consistency.
  */
 void
-checkheap(bool verbose) 
+checkheap(bool verbose)
 {
         void *bp;
-        if (verbose)
-                printf("Heap (%p):\n", heap_listp);
 
-        /* Checks the prologue header size and alloc mark. */
-        if (GET_SIZE(HDRP(heap_listp)) != DSIZE ||
-            !GET_ALLOC(HDRP(heap_listp)))
-                printf("Bad prologue header\n");
-        checkblock(heap_listp);
+        for (int i = 0; i < NUM_ARENAS; i++) {
+                struct arena *a = &arenas[i];
 
-        /* For every block in the heap, do the following checks: */
-        for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
                 if (verbose)
-                       printblock(bp);
-                /* Check block */
-                checkblock(bp);
-                
-                /* Check if prev block and current block are both free. */
-                if (bp != heap_listp) {
-                        if ((!GET_ALLOC(PREV_BLKP(HDRP(bp)))) && (!GET_ALLOC(PREV_BLKP(HDRP(bp))))) {
+                        printf("Arena %d heap (%p):\n", i, a->heap_listp);
+
+                /* Checks the prologue header size and alloc mark. */
+                if (GET_SIZE(HDRP(a->heap_listp)) != DSIZE ||
+                    !GET_ALLOC(HDRP(a->heap_listp)))
+                        printf("Bad prologue header\n");
+                checkblock(a->heap_listp);
+
+                /* For every block in the heap, do the following checks: */
+                bool prev_alloc = true;  /* The prologue is allocated. */
+                for (bp = a->heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+                        if (verbose)
+                               printblock(bp);
+                        /* Check block */
+                        checkblock(bp);
+
+                        /* Check the prev-allocated bit against the walk. */
+                        if (bp != (void *)a->heap_listp &&
+                            (GET_PREVALLOC(HDRP(bp)) != 0) != prev_alloc)
+                                printf("Error: %p prev-alloc bit is stale\n", bp);
+
+                        /* Check if prev block and current block are both free. */
+                        if (bp != (void *)a->heap_listp && !defer_coalescing &&
+                            !prev_alloc && !GET_ALLOC(HDRP(bp)))
                                 printf("Coalesce error: two continuous free blocks. \n");
-                        }
+
+                        prev_alloc = GET_ALLOC(HDRP(bp));
                 }
-        }
 
-        /* Check that every block in every segrageted free list is actually free. */
-        for (int i = 0; i < NUM_SEGS; i++) {
-                struct pointers* head = &free_lists[i];
-                struct pointers* temp = head->next;
-                while (&head != &temp) {
-                        if (!GET_ALLOC(HDRP(temp))) {
-                                printf("Block %p in list index %i is not free.\n", temp, i);
+                /* Check that every block in every segrageted free list is actually free.
+                 * The catch-all class lives in the treap and is skipped here. */
+                for (int j = 0; j < NUM_CLASSES - 1; j++) {
+                        struct pointers* head = &a->free_lists[j];
+                        struct pointers* temp = head->next;
+                        while (temp != head) {
+                                if (GET_ALLOC(HDRP(temp))) {
+                                        printf("Block %p in list index %i is not free.\n", temp, j);
+                                }
+                                temp = temp->next;
                         }
-                        temp = temp->next;
                 }
-        }
 
-        /* Checks the epilogue header size and alloc mark. */
-        if (verbose)
-                printblock(bp);
-        if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
-                printf("Bad epilogue header\n");
+                /* Checks the epilogue header size and alloc mark. */
+                if (verbose)
+                        printblock(bp);
+                if (GET_SIZE(HDRP(bp)) != 0 || !GET_ALLOC(HDRP(bp)))
+                        printf("Bad epilogue header\n");
+        }
 }
 
 /*
@@ -670,27 +3626,32 @@ checkheap(bool verbose)
  *   Print the block "bp".
  */
 static void
-printblock(void *bp) 
+printblock(void *bp)
 {
         size_t hsize, fsize;
         bool halloc, falloc;
 
-        checkheap(false);
         hsize = GET_SIZE(HDRP(bp));
-        halloc = GET_ALLOC(HDRP(bp));  
-        fsize = GET_SIZE(FTRP(bp));
-        falloc = GET_ALLOC(FTRP(bp));  
+        halloc = GET_ALLOC(HDRP(bp));
 
         void* hdr = HDRP(bp);
-        void* ftr = FTRP(bp);
 
         if (hsize == 0) {
                  printf("%p: end of heap\n", bp);
                 return;
         }
 
+        /* Allocated blocks have no footer to print. */
+        if (halloc) {
+                printf("%p: header: %p [%zu:a]\n", bp, hdr, hsize);
+                return;
+        }
+
+        fsize = GET_SIZE(FTRP(bp));
+        falloc = GET_ALLOC(FTRP(bp));
+        void* ftr = FTRP(bp);
+
         printf("%p: header: %p [%zu:%c] footer: %p [%zu:%c]\n", bp, hdr,
             hsize, (halloc ? 'a' : 'f'), ftr,
             fsize, (falloc ? 'a' : 'f'));
 }
-
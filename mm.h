@@ -0,0 +1,125 @@
+/*
+ * mm.h - Public interface to the allocator in mm.c.
+ *
+ * The core entry points mirror malloc/free/realloc/calloc.  Everything
+ * else is opt-in: policy setters default to sensible behavior, the
+ * specialized allocation paths (growable, aligned, batched, pooled,
+ * fixed-size) fall back to ordinary blocks, and the observability
+ * hooks (stats, sampled checking, profiling) cost nothing until used.
+ */
+
+#ifndef MM_H
+#define MM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Array lengths in struct mm_stats.  These must match the allocator's
+ * size-class table; mm.c checks the two counts at compile time, so a
+ * retuned class table cannot silently skew a metrics consumer.
+ */
+#define MM_NUM_CLASSES           39
+#define MM_SEARCH_HIST_BUCKETS   8
+
+/*
+ * Free list insertion policies, selectable per size class with
+ * mm_set_insert_policy.  LIFO puts a freed block at the head so the
+ * next malloc reuses the cache-hot block immediately; address order
+ * keeps each list sorted by address, which groups neighbors and lowers
+ * fragmentation for the bigger classes.
+ */
+#define INSERT_LIFO  0
+#define INSERT_ADDR  1
+
+/*
+ * Snapshot of allocator counters, filled in by mm_stats().  Counters are
+ * updated on the hot paths either under the arena lock or with relaxed
+ * atomics, and read without stopping the world, so a snapshot is cheap
+ * but only approximately consistent across fields.
+ */
+struct mm_stats {
+    uint64_t mag_alloc_hits;   /* mallocs served by a thread magazine */
+    uint64_t mag_free_hits;    /* frees absorbed by a thread magazine */
+    uint64_t arena_mallocs;    /* blocks placed from arena free lists */
+    uint64_t arena_frees;      /* blocks freed back to an arena */
+    uint64_t mmap_allocs;      /* blocks served by mmap */
+    uint64_t mmap_frees;       /* mmapped blocks unmapped */
+    uint64_t realloc_calls;    /* mm_realloc calls */
+    uint64_t live_bytes;       /* arena block bytes currently allocated */
+    uint64_t mmap_bytes;       /* bytes currently held in mmapped blocks */
+    uint64_t heap_used;        /* arena region bytes carved out so far */
+    uint64_t extend_calls;     /* extend_heap calls */
+    uint64_t splits;           /* place/realloc block splits */
+    uint64_t coalesces;        /* block merges (including batched ones) */
+    uint64_t madvise_calls;    /* madvise calls that returned pages */
+    uint64_t returned_bytes;   /* page bytes handed back to the kernel */
+    uint64_t class_allocs[MM_NUM_CLASSES];  /* per-class allocation counts */
+    uint64_t class_frees[MM_NUM_CLASSES];   /* per-class free counts */
+    uint64_t search_hist[MM_SEARCH_HIST_BUCKETS];  /* find_block lengths, 2^i buckets */
+    uint64_t remote_frees;     /* frees pushed onto remote-free queues */
+};
+
+/* Fixed-size object pool; the layout is private to mm.c. */
+struct mm_pool;
+
+/* Core allocation interface: */
+int mm_init(void);
+void *mm_malloc(size_t size);
+void mm_free(void *ptr);
+void *mm_realloc(void *ptr, size_t size);
+void *mm_realloc_in_place(void *ptr, size_t size);
+void *mm_calloc(size_t nmemb, size_t size);
+
+/* Specialized allocation paths: */
+void *mm_memalign(size_t alignment, size_t size);
+void *mm_malloc_growable(size_t size);
+int mm_malloc_batch(size_t size, size_t count, void **out);
+void mm_free_batch(void **ptrs, size_t count);
+void *mm_malloc_fixed_32(void);
+void *mm_malloc_fixed_64(void);
+void *mm_malloc_fixed_128(void);
+
+/* Object pools: */
+struct mm_pool *mm_pool_create(size_t size);
+void *mm_pool_alloc(struct mm_pool *pool);
+void mm_pool_free(struct mm_pool *pool, void *p);
+void mm_pool_destroy(struct mm_pool *pool);
+
+/* Policy and tuning: */
+int mm_reserve(size_t bytes);
+void mm_set_insert_policy(size_t block_size, int policy);
+void mm_set_deferred_coalescing(bool on);
+void mm_set_growable_headroom(size_t bytes);
+void mm_set_realloc_growth(unsigned percent);
+void mm_set_class_coloring(size_t block_size, bool on);
+
+/* Snapshots for warm process starts: */
+int mm_snapshot(const char *path);
+int mm_init_from_snapshot(const char *path);
+
+/* Observability: */
+size_t mm_heap_used(void);
+void mm_stats(struct mm_stats *st);
+void print_search_stats(void);
+
+/* Heap consistency checkers: */
+void checkheap(bool verbose);
+void checkheap_sampled(long budget_us);
+
+#ifdef MM_PROFILE
+/* Frames kept per allocation-site sample. */
+#define MM_PROFILE_DEPTH 4
+
+/* One sampled allocation, as returned by mm_profile_dump. */
+struct mm_profile_sample {
+        size_t size;                       /* Requested payload bytes */
+        int class_idx;                     /* Segregated list class */
+        void *stack[MM_PROFILE_DEPTH];     /* Innermost frames, caller first */
+};
+
+size_t mm_profile_dump(struct mm_profile_sample *out, size_t max);
+#endif /* MM_PROFILE */
+
+#endif /* MM_H */